@@ -59,18 +59,172 @@
 #include <linux/usb.h>   // usb stuff
 #include <linux/mutex.h> // lock_kernel(), unlock_kernel()
 #include <linux/slab.h>  // kzalloc()
+#include <linux/mm.h>    // vm_area_struct, PAGE_ALIGN()
 #include <linux/errno.h> // pr_err()
 #include <asm/uaccess.h> // copy_to_user(), copy_from_user()
 #include <linux/wait.h>  // wait_queue_head_t structure
+#include <linux/spinlock.h> // spinlock_t, shared with the completion handlers
+#include <linux/moduleparam.h> // module_param()
+#include <linux/log2.h>  // roundup_pow_of_two()
+#include <linux/poll.h>  // poll_wait(), EPOLLIN, EPOLLOUT
+#include <linux/vmalloc.h> // vmalloc_user(), remap_vmalloc_range()
+#include <linux/uio.h>   // struct iov_iter, copy_to_iter(), copy_from_iter()
+#include <linux/kref.h>  // struct kref, kref_get(), kref_put()
+#include <linux/bitops.h> // BIT_ULL(), hweight64()
+#include <linux/jhash.h> // jhash_1word()
+#include <linux/hash.h>  // hash_32()
+#include <linux/filter.h> // bpf_prog_create_from_user(), bpf_prog_run()
+#include <linux/timekeeping.h> // ktime_get(), ktime_mono_to_any()
+#include <linux/netdevice.h> // struct net_device, NAPI
+#include <linux/can/dev.h> // alloc_candev(), can_put_echo_skb()
+#include <linux/sysfs.h> // sysfs_emit()
+#include <linux/atomic.h> // atomic_long_t
+#include <linux/debugfs.h> // debugfs_create_dir(), debugfs_create_file()
+#include <linux/seq_file.h> // seq_printf(), single_open()
+#include <linux/workqueue.h> // INIT_WORK(), schedule_work()
+
+#include "nr_driver.h" // definitions shared with the user space
+
+// generate the code of the tracepoints declared in nr_trace.h, in this file
+//   only
+#define CREATE_TRACE_POINTS
+#include "nr_trace.h"
 
 // vendor and product ids 
 #define VENDOR_ID 0x04d8
 #define PRODUCT_ID 0x0070
 #define USB_MINOR_BASE 1
 
+// upper bound for the number of IN urbs kept in flight
+#define NR_MAX_IN_URBS 32
+
+// upper bound for the number of OUT urbs of the transmit pool
+#define NR_MAX_OUT_URBS 32
+
+// time given to the frames still in flight when the file is closed
+#define NR_FLUSH_TIMEOUT_MS 1000
+
+// maximal number of files open for reading on one device: each one is given a
+//   bit in the delivery masks of the receive ring
+#define NR_MAX_READERS 64
+
+// maximal number of reader groups on one device
+#define NR_MAX_GROUPS 8
+
+// free entry of the exact match table of a filter, not a valid identifier
+//   (the bits between the 29 bits identifier and NR_CAN_EFF_FLAG are set)
+#define NR_FILTER_EMPTY 0xffffffffU
+
+// number of urb completion status counted by the statistics, -status from 0
+//   to NR_STATUS_CODES - 2, the last one counts all the others
+#define NR_STATUS_CODES 128
+
+// number of buckets of the latency histograms: bucket i counts the latencies
+//   from 2^(i-1) to 2^i - 1 nanoseconds, the last one all the longer ones
+#define NR_HIST_BUCKETS 40
+
+// bounds of the receive and transmit rings, in frames
+#define NR_MIN_RING 2
+#define NR_MAX_RING 65536
+
+// number of interrupt IN urbs permanently submitted to the device. With more
+//   than one urb in flight the host controller always has a request queued
+//   for the endpoint, so the adapter is polled every bInterval even while the
+//   previous completion is still being handled.
+static unsigned int in_urbs = 4;
+module_param(in_urbs, uint, 0444);
+MODULE_PARM_DESC(in_urbs, "number of interrupt IN urbs kept in flight (1-32)");
+
+// number of OUT urbs (with their buffer) allocated for the transmit path.
+//   write() only waits when all of them are in flight.
+static unsigned int out_urbs = 8;
+module_param(out_urbs, uint, 0444);
+MODULE_PARM_DESC(out_urbs, "number of interrupt OUT urbs in the transmit pool (1-32)");
+
+// number of received frames the driver can hold while nobody reads them.
+//   Rounded up to a power of two so that the ring indexes can be masked.
+static unsigned int rx_fifo_frames = 64;
+module_param(rx_fifo_frames, uint, 0444);
+MODULE_PARM_DESC(rx_fifo_frames,
+                 "size of the receive ring in 64-byte frames (2-65536)");
+
+// number of frames a program can queue in the memory mapped transmit ring
+static unsigned int tx_ring_frames = 256;
+module_param(tx_ring_frames, uint, 0444);
+MODULE_PARM_DESC(tx_ring_frames,
+                 "size of the transmit ring in 64-byte frames (2-65536)");
+
+// register a SocketCAN network interface (can0...) for the adapter instead of
+//   the character device /dev/nr_driverX
+static bool socketcan;
+module_param(socketcan, bool, 0444);
+MODULE_PARM_DESC(socketcan,
+                 "register a SocketCAN interface instead of /dev/nr_driverX");
+
+// bitrate of the CAN bus, as configured in the adapter: the driver has no way
+//   to change it, it is only reported to SocketCAN ("ip -details link")
+static unsigned int can_bitrate = 500000;
+module_param(can_bitrate, uint, 0444);
+MODULE_PARM_DESC(can_bitrate, "bitrate of the CAN bus reported to SocketCAN");
+
 // Prevent races between open() and disconnect
 static DEFINE_MUTEX(disconnect_mutex);
 
+// counters of a device, exported in sysfs (see the STATISTICS section). They
+//   are updated from the completion handlers and from the file operations
+//   without any common lock, hence the atomics.
+struct nr_stats
+{
+    // urbs submitted and given back (whatever their status) by the USB core
+    atomic_long_t rx_urbs_submitted;
+    atomic_long_t rx_urbs_completed;
+    atomic_long_t tx_urbs_submitted;
+    atomic_long_t tx_urbs_completed;
+
+    // frames received (stored in the receive ring) and sent successfully
+    atomic_long_t rx_frames;
+    atomic_long_t rx_bytes;
+    atomic_long_t tx_frames;
+    atomic_long_t tx_bytes;
+
+    // urbs completed with an error (not counting the unlinks)
+    atomic_long_t rx_errors;
+    atomic_long_t tx_errors;
+
+    // frames overwritten in the receive ring before a reader got them, summed
+    //   over the readers
+    atomic_long_t rx_overruns;
+
+    // urbs completed with each status, indexed by -status
+    atomic_long_t rx_status[NR_STATUS_CODES];
+    atomic_long_t tx_status[NR_STATUS_CODES];
+};
+
+// log2 latency histogram, exported in debugfs (see the LATENCY HISTOGRAMS
+//   section)
+struct nr_hist
+{
+    atomic_long_t count[NR_HIST_BUCKETS];
+};
+
+// what the completion handler of an urb gets as context
+struct nr_urb
+{
+    struct usb_nr *dev;
+
+    // time of the last submission, for the latency histograms
+    ktime_t submitted;
+
+    // OUT urbs only: time write() was called for the frame, 0 for the frames
+    //   of the transmit ring and of the network interface
+    ktime_t call_start;
+
+    // OUT urbs only: the file whose write() queued the frame, which gets its
+    //   error, NULL for the frames of the transmit ring and of the network
+    //   interface. Protected by int_out_lock.
+    struct nr_file *owner;
+};
+
 //------------------------------------------------------------
 //             STRUCT CORRESPONDING TO THE DEVICE
 //------------------------------------------------------------
@@ -83,17 +237,64 @@ struct usb_nr
     // to record the interrupt out endpoint, defined in probe()
     struct usb_endpoint_descriptor *int_out_endpoint;
 
-    // the urb to read data with
-    // memory allocated in probe()
-    // initialized in open()
-    // used in read()
-    struct urb *int_in_urb;
-
-    // the urb to write data with
-    // memory allocated in probe()
-    // initialized in open()
-    // used in write()
-    struct urb *int_out_urb;
+    // the urbs to read data with
+    // memory allocated, initialized and submitted in probe()
+    // resubmitted by the completion handler nr_read_int_callback()
+    // killed in disconnect()
+    struct urb *int_in_urbs[NR_MAX_IN_URBS];
+
+    // number of urbs in int_in_urbs
+    unsigned int n_in_urbs;
+
+    // every submitted IN urb is anchored here so that they can be killed
+    //   all at once with usb_kill_anchored_urbs()
+    struct usb_anchor int_in_anchor;
+
+    // the IN urbs (bit i for int_in_urbs[i]) stopped by a stalled endpoint,
+    //   resubmitted by in_halt_work once the halt is cleared: usb_clear_halt()
+    //   sleeps, it can not be called from the completion handler
+    unsigned long in_halted;
+    struct work_struct in_halt_work;
+
+    // the urbs to write data with, each one with its own buffer
+    // memory allocated and initialized in probe()
+    // submitted in write(), given back to the pool by nr_write_int_callback()
+    struct urb *int_out_urbs[NR_MAX_OUT_URBS];
+
+    // number of urbs in int_out_urbs
+    unsigned int n_out_urbs;
+
+    // the pool of urbs not in flight, write() takes the last one
+    struct urb *tx_free[NR_MAX_OUT_URBS];
+    unsigned int tx_free_count;
+
+    // the error of the last frame of the transmit ring that could not be
+    //   sent, given back by the next NR_IOC_TX_KICK (the errors of write()
+    //   are kept by each file, see struct nr_file)
+    int tx_error;
+
+    // protects tx_free, tx_free_count, the errors and the owners of the urbs
+    //   against the completion handler
+    spinlock_t int_out_lock;
+
+    // the OUT urbs in flight, to wait for them in flush() and to kill them
+    //   in disconnect()
+    struct usb_anchor int_out_anchor;
+
+    // the transmit ring (layout described in nr_driver.h), filled by a
+    //   program that mapped it and drained by nr_tx_ring_drain() into the
+    //   urbs of the pool. Protected by int_out_lock.
+    struct nr_ring_header *tx_ring;
+    struct nr_ring_slot *tx_slots;
+    unsigned int tx_ring_size;
+    unsigned long tx_ring_bytes;
+
+    // free running index of the next frame of the transmit ring to send,
+    //   tx_ring->tail is the copy given to the user space
+    unsigned int tx_tail;
+
+    // number of frames of the transmit ring that could not be sent
+    unsigned long tx_ring_overruns;
 
     //  The usb device for this device, used to intialize the urb
     //  A USB device driver commonly has to convert data from a given
@@ -106,40 +307,307 @@ struct usb_nr
     
     struct usb_device *usbdev;
 
-    // the buffer to receive data (from the device through the urb in)
-    unsigned char *int_in_buffer;
+    // the receive ring (layout described in nr_driver.h), filled by the
+    //   completion handler. Every open file reads it with its own cursor
+    //   (struct nr_file), through read() or through a mapping. Allocated with
+    //   vmalloc_user() as it is shared with the user space: the header on the
+    //   first page, then the slots.
+    struct nr_ring_header *rx_ring;
+    struct nr_ring_slot *rx_slots;
+
+    // number of slots (a power of two)
+    unsigned int rx_ring_size;
+
+    // size of the allocation (and of the largest possible mapping)
+    unsigned long rx_ring_bytes;
+
+    // free running index of the next frame written by the completion handler.
+    //   rx_ring->head is a copy given to the user space: the driver never
+    //   reads anything back from the shared page.
+    unsigned int rx_head;
 
-    // number of bytes received in the buffer after the urb in request
-    size_t len_in_buffer;
+    // for each slot of the receive ring, the readers it was delivered to (one
+    //   bit per reader, see readers[]), computed by the completion handler
+    u64 *rx_deliver;
 
-    // the buffer to receive data (from the device through the urb in)
-    unsigned char *int_out_buffer;
+    // the files open for reading, indexed by their reader bit
+    struct nr_file *readers[NR_MAX_READERS];
 
-    // a read is going on (an urb has been sent)
-    bool ongoing_read;
+    // the readers not in a group, which get every frame
+    u64 rx_broadcast;
 
-    // a write is going on (an urb has been sent)
-    bool outgoing_write;
+    // the readers with acceptance filters or a filter program (nr_file.filter
+    //   and nr_file.prog)
+    u64 rx_filtered;
 
-    // to wait for an ongoing read (an urb that has not been processed yet)
-    wait_queue_head_t int_in_wait;
-    // to wait for an outgoing write (an urb that has not been processed yet)
+    // the groups of readers sharing the frames (NR_IOC_SET_GROUP), a group
+    //   with no member is free
+    struct nr_group
+    {
+        u32 id;
+        u32 mode;
+        u64 members;
+
+        // number of frames dealt by a round robin group
+        unsigned int next;
+    } groups[NR_MAX_GROUPS];
+
+    // protects the ring, the cursors of the readers, the readers and the
+    //   groups against the completion handler (which runs in interrupt
+    //   context)
+    spinlock_t int_in_lock;
+    // to wait for an OUT urb to come back in the pool
     wait_queue_head_t int_out_wait;
+
+    // The structure is shared by the interface (from probe() to disconnect())
+    //   and by every open file, it is freed when the last of them lets it go
+    //   (see nr_delete()). Files can stay open after the device is unplugged.
+    struct kref kref;
+
+    // set by disconnect(): the urbs are poisoned and every operation on the
+    //   files still open fails with -ENODEV
+    bool disconnected;
+
+    // the SocketCAN interface when the module is loaded with socketcan=1
+    //   (there is no character device then), NULL otherwise
+    struct net_device *netdev;
+
+    // what the driver did with the device, see the STATISTICS section
+    struct nr_stats stats;
+
+    // the context of each urb (urb->context), at the same index as the urb
+    struct nr_urb in_ctx[NR_MAX_IN_URBS];
+    struct nr_urb out_ctx[NR_MAX_OUT_URBS];
+
+    // latencies, from the submission of an urb to its completion, from the
+    //   call to read() to the frames given back, and from the call to write()
+    //   to the completion of the urb of the frame
+    struct nr_hist hist_rx_urb;
+    struct nr_hist hist_tx_urb;
+    struct nr_hist hist_read;
+    struct nr_hist hist_write;
+
+    // directory of the device in debugfs
+    struct dentry *debugfs;
 };
 
+// acceptance filters of a reader (NR_IOC_SET_FILTER)
+struct nr_filter
+{
+    unsigned int n_masks;
+    struct nr_can_filter masks[NR_MAX_MASK_FILTERS];
+
+    // the exact match list, as an open addressing hash table of 2^ids_bits
+    //   entries (at least twice the number of identifiers so that a lookup
+    //   quickly meets a free entry), NR_FILTER_EMPTY when free
+    unsigned int n_ids;
+    unsigned int ids_bits;
+    u32 ids[];
+};
+
+//------------------------------------------------------------
+//            STRUCT CORRESPONDING TO AN OPEN FILE
+//------------------------------------------------------------
+// Everything that belongs to one open file descriptor rather than to the
+//   device lives here, pointed to by filp->private_data: a process opening
+//   /dev/nr_driverX never touches the state of the other ones.
+struct nr_file
+{
+    // the device this file was opened on, a reference is held until release()
+    struct usb_nr *dev;
+
+    // Cursor of this reader in the receive ring of the device: free running
+    //   index of the next frame to give back. Every reader has its own and
+    //   sees every frame; the completion handler never waits for a slow
+    //   reader, it overwrites the oldest frame and the reader finds out it has
+    //   been lapped. Protected by dev->int_in_lock.
+    unsigned int rx_seq;
+
+    // number of frames given back to this reader
+    unsigned long rx_frames;
+
+    // number of frames this reader missed because they were overwritten
+    //   before it read them
+    unsigned long rx_overruns;
+
+    // bit of this reader in the delivery masks (dev->rx_deliver), -1 if the
+    //   file is not open for reading
+    int rx_id;
+
+    // number of frames delivered to this reader and not read yet, as far as
+    //   the completion handler knows (a reader that has been lapped finds out
+    //   in nr_rx_take())
+    unsigned int rx_pending;
+
+    // group this reader belongs to, NULL if it gets every frame
+    struct nr_group *group;
+
+    // acceptance filters of this reader, NULL if it wants every frame
+    struct nr_filter *filter;
+
+    // filter program of this reader (NR_IOC_SET_BPF), NULL if none
+    struct bpf_prog *prog;
+
+    // clock of the timestamps of the headers read() puts before each frame,
+    //   NR_TSTAMP_NONE when it gives the bare frames (NR_IOC_SET_RX_TSTAMP)
+    unsigned int rx_tstamp;
+
+    // to wait for a frame delivered to this reader. Each reader has its own
+    //   queue so that the completion handler only wakes up the ones a frame
+    //   is for.
+    wait_queue_head_t rx_wait;
+
+    // the error of the last frame written by this file that could not be
+    //   sent, given back by its next write() (or flush()) as the frame itself
+    //   has already been accepted. Protected by dev->int_out_lock.
+    int tx_error;
+
+    // number of OUT urbs in flight with frames written by this file, flush()
+    //   waits for them only. Protected by dev->int_out_lock.
+    unsigned int tx_inflight;
+};
+
+// Free the urbs and their buffers. The buffers come from the DMA pools of the
+//   host controller, which may go away once the device is unplugged: this is
+//   done by disconnect() (or by probe() if it fails), not when the last file
+//   is closed.
+static void nr_free_urbs(struct usb_nr *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->n_in_urbs; ++i)
+    {
+        // probe() may have failed before allocating all of them
+        if (!dev->int_in_urbs[i])
+            break;
+
+        // the buffer of each IN urb was allocated in probe(), with the size
+        //   of the endpoint
+        usb_free_coherent(dev->usbdev, dev->int_in_endpoint->wMaxPacketSize,
+                          dev->int_in_urbs[i]->transfer_buffer,
+                          dev->int_in_urbs[i]->transfer_dma);
+        usb_free_urb(dev->int_in_urbs[i]);
+    }
+    for (i = 0; i < dev->n_out_urbs; ++i)
+    {
+        if (!dev->int_out_urbs[i])
+            break;
+        // transfer_buffer_length is the length of the last frame sent, not
+        //   the size of the buffer
+        usb_free_coherent(dev->usbdev, dev->int_out_endpoint->wMaxPacketSize,
+                          dev->int_out_urbs[i]->transfer_buffer,
+                          dev->int_out_urbs[i]->transfer_dma);
+        usb_free_urb(dev->int_out_urbs[i]);
+    }
+    dev->n_in_urbs = 0;
+    dev->n_out_urbs = 0;
+}
+
 // function to free all the memory allocated
 void free_usb_nr(struct usb_nr *dev)
 {
-    usb_free_urb(dev->int_in_urb);
-    usb_free_urb(dev->int_out_urb);
+    // already done by disconnect() if the device has been plugged
+    nr_free_urbs(dev);
 
     // release a use of the usb device structure (ust_get_dev in probe function)
     usb_put_dev(dev->usbdev);
-    kfree(dev->int_in_buffer);
-    kfree(dev->int_out_buffer);
+    vfree(dev->rx_ring);
+    kvfree(dev->rx_deliver);
+    vfree(dev->tx_ring);
     kfree(dev);
 }
 
+// called by kref_put() when the last reference to the device is dropped
+static void nr_delete(struct kref *kref)
+{
+    free_usb_nr(container_of(kref, struct usb_nr, kref));
+}
+
+// true when the receive ring holds no frame for this reader
+static bool nr_rx_empty(struct nr_file *file)
+{
+    return READ_ONCE(file->rx_pending) == 0;
+}
+
+// true when the identifier passes the acceptance filters of a reader
+static bool nr_filter_match(const struct nr_filter *filter, u32 id)
+{
+    unsigned int i, h;
+
+    for (i = 0; i < filter->n_masks; ++i)
+        if (((id ^ filter->masks[i].id) & filter->masks[i].mask) == 0)
+            return true;
+
+    if (filter->n_ids == 0)
+        return false;
+    for (h = hash_32(id, filter->ids_bits); filter->ids[h] != NR_FILTER_EMPTY;
+         h = (h + 1) & ((1U << filter->ids_bits) - 1))
+        if (filter->ids[h] == id)
+            return true;
+    return false;
+}
+
+// true when a reader wants the frame: its identifier passes the acceptance
+//   filters, if any, and the filter program, if any, does not return 0
+static bool nr_file_accept(struct nr_file *file, const unsigned char *data,
+                           u32 id)
+{
+    if (file->filter && !nr_filter_match(file->filter, id))
+        return false;
+    return !file->prog || bpf_prog_run(file->prog, data) != 0;
+}
+
+// the readers accepting a frame: the ones without filters, and the ones
+//   whose filters let it through. Called with int_in_lock held.
+static u64 nr_filter_accept(struct usb_nr *dev, const unsigned char *data,
+                            u32 id)
+{
+    u64 accept = ~dev->rx_filtered;
+    int i;
+
+    for (i = 0; i < NR_MAX_READERS; ++i)
+        if ((dev->rx_filtered & BIT_ULL(i)) &&
+            nr_file_accept(dev->readers[i], data, id))
+            accept |= BIT_ULL(i);
+    return accept;
+}
+
+// Choose the member of a group the frame goes to among the ones accepting it,
+//   returns its reader bit or -1 if there is none. Called with int_in_lock
+//   held.
+static int nr_group_pick(struct nr_group *group, u64 accept, u32 id)
+{
+    u64 members = group->members & accept;
+    unsigned int n = hweight64(members);
+    unsigned int k;
+    int i;
+
+    if (n == 0)
+        return -1;
+
+    // rank of the member among the n ones: the same identifier always gives
+    //   the same rank, and so the same member while the group does not change
+    if (group->mode == NR_GROUP_HASH_ID)
+        k = jhash_1word(id, 0) % n;
+    else
+        k = group->next++ % n;
+
+    for (i = 0; i < NR_MAX_READERS; ++i)
+        if ((members & BIT_ULL(i)) && k-- == 0)
+            return i;
+    return -1;
+}
+
+// Remove a reader from its group, if any. Called with int_in_lock held.
+static void nr_group_leave(struct nr_file *file)
+{
+    if (!file->group)
+        return;
+    file->group->members &= ~BIT_ULL(file->rx_id);
+    file->group = NULL;
+    file->dev->rx_broadcast |= BIT_ULL(file->rx_id);
+}
+
 // needed to be declared here for the nr_open() function
 static struct usb_driver nr_driver;
 
@@ -173,8 +641,13 @@ static int nr_open(struct inode *inode, struct file *filp)
     // define a pointer over a device struct (usb_ur)
     struct usb_nr *dev = NULL;
 
+    // the state of this open file
+    struct nr_file *file = NULL;
+
     int retval = 0;
     int subminor;
+    int i;
+    unsigned long flags;
     struct usb_interface *interface; // to get the device interface
 
     // obtain the minor number from an inode. Note that traditionnally,
@@ -182,6 +655,10 @@ static int nr_open(struct inode *inode, struct file *filp)
     //   and the minor number determine wich device is referred to
     subminor = iminor(inode);
 
+    // disconnect() must not free the device between the moment we find it and
+    //   the moment we hold our reference
+    mutex_lock(&disconnect_mutex);
+
     // from the minor and the driver it is possible to retrieve the interface
     interface = usb_find_interface(&nr_driver, subminor);
 
@@ -202,51 +679,751 @@ static int nr_open(struct inode *inode, struct file *filp)
         goto exit;
     }
 
-    // save our data pointer in the file's private structure
-    //   to be able to recover it in the fops functions (read, write...)
-    filp->private_data = dev;
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+    {
+        retval = -ENOMEM;
+        goto exit;
+    }
+    file->dev = dev;
+    file->rx_id = -1;
+    init_waitqueue_head(&file->rx_wait);
+
+    if (filp->f_mode & FMODE_READ)
+    {
+        // a reader gets a bit in the delivery masks and starts with the next
+        //   frame received
+        spin_lock_irqsave(&dev->int_in_lock, flags);
+        for (i = 0; i < NR_MAX_READERS; ++i)
+        {
+            if (!dev->readers[i])
+            {
+                file->rx_id = i;
+                dev->readers[i] = file;
+                dev->rx_broadcast |= BIT_ULL(i);
+                file->rx_seq = dev->rx_head;
+                break;
+            }
+        }
+        spin_unlock_irqrestore(&dev->int_in_lock, flags);
+
+        if (file->rx_id < 0)
+        {
+            kfree(file);
+            retval = -EMFILE;
+            goto exit;
+        }
+    }
 
-    // variable to get the number of bytes of the buffer receiving
-    //   from the urb request
-    dev->len_in_buffer = 0;
+    // the device stays allocated as long as this file is open
+    kref_get(&dev->kref);
 
-    // variable to test if an in urb request is going on
-    dev->ongoing_read = false;
+    // save our data pointer in the file's private structure
+    //   to be able to recover it in the fops functions (read, write...)
+    filp->private_data = file;
 
-    // variable to test if an out urb request is going on
-    dev->outgoing_write = false;
+    // read_iter() and write_iter() honour IOCB_NOWAIT, io_uring can issue its
+    //   requests inline instead of handing them to a worker thread
+    filp->f_mode |= FMODE_NOWAIT;
+    trace_nr_open(subminor, file->rx_id);
 exit:
+    mutex_unlock(&disconnect_mutex);
     return retval;
 }
-// release, called when the opened file is closed
-static int nr_release(struct inode *inode, struct file *file)
+// release, called when the opened file is closed (the last copy of its
+//   descriptor and the last memory mapping of it)
+static int nr_release(struct inode *inode, struct file *filp)
+{
+    struct nr_file *file = filp->private_data;
+    struct usb_nr *dev = file->dev;
+    unsigned long flags;
+    unsigned int i;
+
+    trace_nr_release(iminor(inode), file->rx_id);
+
+    // flush() may have given up on our frames still in flight: their
+    //   completion must not report to us any more
+    spin_lock_irqsave(&dev->int_out_lock, flags);
+    for (i = 0; i < dev->n_out_urbs; ++i)
+        if (dev->out_ctx[i].owner == file)
+            dev->out_ctx[i].owner = NULL;
+    spin_unlock_irqrestore(&dev->int_out_lock, flags);
+
+    if (file->rx_id >= 0)
+    {
+        // the completion handler must not deliver to us any more
+        spin_lock_irqsave(&dev->int_in_lock, flags);
+        nr_group_leave(file);
+        dev->rx_broadcast &= ~BIT_ULL(file->rx_id);
+        dev->rx_filtered &= ~BIT_ULL(file->rx_id);
+        dev->readers[file->rx_id] = NULL;
+        spin_unlock_irqrestore(&dev->int_in_lock, flags);
+    }
+    kvfree(file->filter);
+    if (file->prog)
+        bpf_prog_destroy(file->prog);
+    kfree(file);
+
+    // the device may have been unplugged, in which case we free it here
+    kref_put(&dev->kref, nr_delete);
+    return 0;
+}
+
+// count the completion status of an urb in one of the tables of nr_stats
+static void nr_count_status(atomic_long_t *table, int status)
+{
+    atomic_long_inc(&table[min_t(unsigned int, -status, NR_STATUS_CODES - 1)]);
+}
+
+// count a latency in a histogram
+static void nr_hist_add(struct nr_hist *hist, ktime_t start, ktime_t end)
+{
+    s64 ns = max_t(s64, ktime_to_ns(ktime_sub(end, start)), 0);
+
+    atomic_long_inc(&hist->count[min_t(unsigned int, fls64(ns),
+                                       NR_HIST_BUCKETS - 1)]);
+}
+
+// The USB core function submitting an urb. The KUnit tests (built with
+//   CONFIG_NR_DRIVER_KUNIT_TEST, see nr_driver_test.c) replace it by a fake
+//   one, to run the completion handlers on urbs that never reach a device.
+#if IS_ENABLED(CONFIG_NR_DRIVER_KUNIT_TEST)
+static int (*nr_usb_submit_urb)(struct urb *urb, gfp_t mem_flags) =
+    usb_submit_urb;
+#else
+#define nr_usb_submit_urb usb_submit_urb
+#endif
+
+// Anchor an IN urb and submit it. Every IN submission goes through here.
+static int nr_submit_in_urb(struct usb_nr *dev, struct urb *urb, gfp_t gfp)
+{
+    struct nr_urb *ctx = urb->context;
+    int rs;
+
+    // before the submission: the completion may run before usb_submit_urb()
+    //   returns
+    ctx->submitted = ktime_get();
+    trace_nr_urb_submit(urb);
+    usb_anchor_urb(urb, &dev->int_in_anchor);
+    rs = nr_usb_submit_urb(urb, gfp);
+    if (rs)
+    {
+        usb_unanchor_urb(urb);
+        return rs;
+    }
+    atomic_long_inc(&dev->stats.rx_urbs_submitted);
+    return 0;
+}
+
+// Anchor an OUT urb and submit it. Every OUT submission goes through here.
+static int nr_submit_out_urb(struct usb_nr *dev, struct urb *urb, gfp_t gfp)
 {
-    // printk("_NR_ nr_release()\n");
+    struct nr_urb *ctx = urb->context;
+    int rs;
+
+    ctx->submitted = ktime_get();
+    trace_nr_urb_submit(urb);
+    usb_anchor_urb(urb, &dev->int_out_anchor);
+    rs = nr_usb_submit_urb(urb, gfp);
+    if (rs)
+    {
+        usb_unanchor_urb(urb);
+        return rs;
+    }
+    atomic_long_inc(&dev->stats.tx_urbs_submitted);
     return 0;
 }
+
+// the SocketCAN frontend, see below
+static void nr_can_rx(struct usb_nr *dev);
+static void nr_can_tx_done(struct usb_nr *dev, struct urb *urb);
+static void nr_can_tx_wake(struct usb_nr *dev);
+
 // The completion handler function that is called by the USB core when
 //   the urb is completely transferred or when an error occurs to the urb. Within
 //   this function, the USB driver may inspect the urb, free it, or resubmit it
 //   for another transfer.
+// The IN urbs are never waited for by read(): they are submitted once in
+//   probe() and this handler appends the received frame to the receive ring
+//   and puts the urb straight back in flight, so the device keeps being polled
+//   whatever the reader is doing.
 static void nr_read_int_callback(struct urb *urb)
 {
+    struct nr_urb *ctx = urb->context;
     struct usb_nr *dev;
-    dev = urb->context;
+    struct nr_ring_slot *slot;
+    unsigned long flags;
+    unsigned int len;
+    u64 deliver, accept;
+    u32 id;
+    int rs, i;
+
+    // the frame has just arrived: the sooner the time is taken, the less it
+    //   depends on what the cpu was doing
+    ktime_t now = ktime_get();
+
+    dev = ctx->dev;
+    trace_nr_urb_complete(urb);
+    atomic_long_inc(&dev->stats.rx_urbs_completed);
+    nr_count_status(dev->stats.rx_status, urb->status);
+
+    // sync/async unlink faults aren't errors, but the urb is being killed
+    //   (disconnect) so it must not be resubmitted
+    if (urb->status == -ENOENT ||
+        urb->status == -ECONNRESET ||
+        urb->status == -ESHUTDOWN)
+        return;
 
-    // sync/async unlink faults aren't errors
     if (urb->status)
     {
-        if (!(urb->status == -ENOENT ||
-              urb->status == -ECONNRESET ||
-              urb->status == -ESHUTDOWN))
-            pr_err("_NR_ %s - nonzero write interuption status received: %d\n",
-                   __func__, urb->status);
+        // the urb completes every bInterval: an error that keeps coming back
+        //   must not flood the log
+        dev_err_ratelimited(&dev->usbdev->dev,
+                            "_NR_ %s - nonzero read interuption status "
+                            "received: %d\n", __func__, urb->status);
+        atomic_long_inc(&dev->stats.rx_errors);
+        switch (urb->status)
+        {
+        case -EPROTO:
+        case -EILSEQ:
+        case -ETIME:
+            // the device does not answer any more (typically unplugged,
+            //   before disconnect() is called): resubmitting would only fail
+            //   again, at once
+            return;
+        case -EPIPE:
+            // the endpoint is stalled, the halt is cleared from a work item
+            //   which then resubmits the urb
+            set_bit(ctx - dev->in_ctx, &dev->in_halted);
+            schedule_work(&dev->in_halt_work);
+            return;
+        default:
+            goto resubmit;
+        }
+    }
+    nr_hist_add(&dev->hist_rx_urb, ctx->submitted, now);
+
+    // an empty report is not a frame: read() could not give it back, and the
+    //   network interface would decode what the slot held before
+    if (urb->actual_length == 0)
+        goto resubmit;
+
+    // we are called in interrupt context, read() may be looking at the
+    //   ring on another cpu.
+    // The frame always goes in, overwriting the oldest one once the ring is
+    //   full: the readers have their own cursor, a reader that did not keep up
+    //   counts the frames it missed (see nr_rx_take()).
+    spin_lock_irqsave(&dev->int_in_lock, flags);
+    slot = &dev->rx_slots[dev->rx_head & (dev->rx_ring_size - 1)];
+    len = min_t(unsigned int, urb->actual_length, NR_FRAME_SIZE);
+
+    // the new index goes first: a program reading the slot through a mapping
+    //   while we overwrite it sees the index change (see nr_driver.h)
+    WRITE_ONCE(slot->seq, dev->rx_head);
+    smp_wmb();
+    memcpy(slot->data, urb->transfer_buffer, len);
+    slot->len = len;
+    slot->tstamp = ktime_to_ns(now);
+    atomic_long_inc(&dev->stats.rx_frames);
+    atomic_long_add(len, &dev->stats.rx_bytes);
+
+    // the readers the frame is for: among the ones whose filters accept it,
+    //   every reader not in a group and one member of each group
+    id = nr_frame_can_id(slot->data);
+    accept = dev->rx_filtered ? nr_filter_accept(dev, slot->data, id) : ~0ULL;
+    deliver = dev->rx_broadcast & accept;
+    for (i = 0; i < NR_MAX_GROUPS; ++i)
+    {
+        rs = nr_group_pick(&dev->groups[i], accept, id);
+        if (rs >= 0)
+            deliver |= BIT_ULL(rs);
+    }
+    dev->rx_deliver[dev->rx_head & (dev->rx_ring_size - 1)] = deliver;
+    dev->rx_head++;
+
+    // wake the readers sleeping in the read function, only the ones the frame
+    //   is for
+    for (i = 0; i < NR_MAX_READERS; ++i)
+    {
+        if (!(deliver & BIT_ULL(i)))
+            continue;
+        dev->readers[i]->rx_pending++;
+        wake_up_interruptible(&dev->readers[i]->rx_wait);
+    }
+
+    // the release makes the slot visible before the new head to a program
+    //   reading the ring without any system call
+    smp_store_release(&dev->rx_ring->head, dev->rx_head);
+    spin_unlock_irqrestore(&dev->int_in_lock, flags);
+
+    // the network interface reads the ring too
+    if (dev->netdev)
+        nr_can_rx(dev);
+
+resubmit:
+    // the urb has been removed from the anchor by the USB core before calling
+    //   us, it has to be anchored again before going back in flight
+    rs = nr_submit_in_urb(dev, urb, GFP_ATOMIC);
+    if (rs)
+    {
+        if (rs != -EPERM && rs != -ENODEV)
+            dev_err_ratelimited(&dev->usbdev->dev,
+                                "_NR_ %s - failed resubmitting urb, error %d\n",
+                                __func__, rs);
+    }
+}
+
+// Clear the halt of the stalled IN endpoint and put back in flight the urbs
+//   it stopped. Scheduled by the completion handler, cancelled by
+//   disconnect() before the urbs are freed.
+static void nr_in_halt_work(struct work_struct *work)
+{
+    struct usb_nr *dev = container_of(work, struct usb_nr, in_halt_work);
+    unsigned int i;
+    int rs;
+
+    rs = usb_clear_halt(dev->usbdev,
+                        usb_rcvintpipe(dev->usbdev,
+                                       dev->int_in_endpoint->bEndpointAddress));
+    if (rs)
+    {
+        // the urbs stay stopped, the device has probably been unplugged
+        dev_err_ratelimited(&dev->usbdev->dev,
+                            "_NR_ %s - clearing the halt failed, error %d\n",
+                            __func__, rs);
+        return;
+    }
+
+    for (i = 0; i < dev->n_in_urbs; ++i)
+    {
+        if (!test_and_clear_bit(i, &dev->in_halted))
+            continue;
+        // fails with -EPERM once disconnect() poisoned the urbs
+        rs = nr_submit_in_urb(dev, dev->int_in_urbs[i], GFP_KERNEL);
+        if (rs && rs != -EPERM && rs != -ENODEV)
+            dev_err_ratelimited(&dev->usbdev->dev,
+                                "_NR_ %s - failed resubmitting urb, error %d\n",
+                                __func__, rs);
+    }
+}
+
+// Submit all the IN urbs prepared in probe(). Called once the device is
+//   ready, the urbs then stay in flight until disconnect().
+static int nr_start_in_urbs(struct usb_nr *dev)
+{
+    unsigned int i;
+    int rs;
+
+    for (i = 0; i < dev->n_in_urbs; ++i)
+    {
+        rs = nr_submit_in_urb(dev, dev->int_in_urbs[i], GFP_KERNEL);
+        if (rs)
+        {
+            pr_err("_NR_ %s - failed submitting urb, error %d\n", __func__,
+                   rs);
+            // poisoned, not only killed: a stalled urb could otherwise be
+            //   resubmitted by in_halt_work before probe() frees them
+            for (i = 0; i < dev->n_in_urbs; ++i)
+                usb_poison_urb(dev->int_in_urbs[i]);
+            cancel_work_sync(&dev->in_halt_work);
+            return rs;
+        }
+    }
+    return 0;
+}
+
+// true when the request must not sleep: file opened with O_NONBLOCK, or
+//   IOCB_NOWAIT set by io_uring (which then retries from a worker thread only
+//   if we answer -EAGAIN) or by preadv2(RWF_NOWAIT)
+static bool nr_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_flags & IOCB_NOWAIT) ||
+           (iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+// Take the next frame of the receive ring for this reader and copy it to
+//   frame (at least NR_FRAME_SIZE bytes), and its index, length and monotonic
+//   timestamp to hdr. Returns its length, -EAGAIN if the reader has read every
+//   frame or -ENOSPC if the frame is longer than room, in which case it stays
+//   in the ring for the next read.
+static ssize_t nr_rx_take(struct nr_file *file, unsigned char *frame,
+                          size_t room, struct nr_rx_header *hdr)
+{
+    struct usb_nr *dev = file->dev;
+    struct nr_ring_slot *slot;
+    unsigned long flags;
+    unsigned int seq, avail;
+    u32 snap;
+    size_t len;
+
+    spin_lock_irqsave(&dev->int_in_lock, flags);
+    // the completion handler went around the ring since our last read: the
+    //   frames before head - rx_ring_size have been overwritten. Those of
+    //   them that were for us are the ones we were told about and can not
+    //   find in the ring any more.
+    if (dev->rx_head - file->rx_seq > dev->rx_ring_size)
+    {
+        file->rx_seq = dev->rx_head - dev->rx_ring_size;
+        avail = 0;
+        for (seq = file->rx_seq; seq != dev->rx_head; ++seq)
+            if (dev->rx_deliver[seq & (dev->rx_ring_size - 1)] &
+                BIT_ULL(file->rx_id))
+                avail++;
+        file->rx_overruns += file->rx_pending - avail;
+        atomic_long_add(file->rx_pending - avail, &dev->stats.rx_overruns);
+        if (file->rx_pending != avail)
+            trace_nr_overflow(true, file->rx_id, file->rx_pending - avail);
+        file->rx_pending = avail;
+    }
+
+    // skip the frames given to other members of our group
+    while (file->rx_seq != dev->rx_head &&
+           !(dev->rx_deliver[file->rx_seq & (dev->rx_ring_size - 1)] &
+             BIT_ULL(file->rx_id)))
+        file->rx_seq++;
+
+    if (dev->rx_head == file->rx_seq)
+    {
+        spin_unlock_irqrestore(&dev->int_in_lock, flags);
+        return -EAGAIN;
+    }
+    slot = &dev->rx_slots[file->rx_seq & (dev->rx_ring_size - 1)];
+    len = min_t(size_t, slot->len, NR_FRAME_SIZE);
+
+    // the filter program tells how much of the frame we keep. It gives the
+    //   same answer as when the frame was received, unless it has been
+    //   replaced since then by one that drops the frame: it is given whole.
+    if (file->prog)
+    {
+        snap = bpf_prog_run(file->prog, slot->data);
+        if (snap)
+            len = min_t(size_t, len, snap);
+    }
+    if (len > room)
+    {
+        spin_unlock_irqrestore(&dev->int_in_lock, flags);
+        return -ENOSPC;
+    }
+    memcpy(frame, slot->data, len);
+    hdr->tstamp = slot->tstamp;
+    hdr->seq = file->rx_seq;
+    hdr->len = len;
+    hdr->flags = 0;
+    file->rx_seq++;
+    file->rx_frames++;
+    file->rx_pending--;
+    spin_unlock_irqrestore(&dev->int_in_lock, flags);
+    return len;
+}
+
+// Make a reader join a group (or leave its group when req->group is 0).
+static int nr_set_group(struct nr_file *file, const struct nr_group_req *req)
+{
+    struct usb_nr *dev = file->dev;
+    struct nr_group *group = NULL;
+    unsigned long flags;
+    bool create = false;
+    u64 self;
+    int i;
+
+    if (file->rx_id < 0)
+        return -EBADF;
+    if (req->mode != NR_GROUP_ROUND_ROBIN && req->mode != NR_GROUP_HASH_ID)
+        return -EINVAL;
+    self = BIT_ULL(file->rx_id);
+
+    spin_lock_irqsave(&dev->int_in_lock, flags);
+    if (req->group == 0)
+    {
+        nr_group_leave(file);
+        spin_unlock_irqrestore(&dev->int_in_lock, flags);
+        return 0;
+    }
+
+    // The group may already have other members, otherwise a free one is
+    //   taken (a group whose only member is this reader counts as free). It
+    //   is looked for before leaving the current one: a request that fails
+    //   leaves the reader where it was.
+    for (i = 0; i < NR_MAX_GROUPS; ++i)
+        if ((dev->groups[i].members & ~self) &&
+            dev->groups[i].id == req->group)
+            group = &dev->groups[i];
+    if (group && group->mode != req->mode)
+    {
+        spin_unlock_irqrestore(&dev->int_in_lock, flags);
+        return -EINVAL;
+    }
+    for (i = 0; !group && i < NR_MAX_GROUPS; ++i)
+    {
+        if (!(dev->groups[i].members & ~self))
+        {
+            group = &dev->groups[i];
+            create = true;
+        }
+    }
+    if (!group)
+    {
+        spin_unlock_irqrestore(&dev->int_in_lock, flags);
+        return -ENOSPC;
+    }
+
+    nr_group_leave(file);
+    if (create)
+    {
+        group->id = req->group;
+        group->mode = req->mode;
+        group->next = 0;
+    }
+    dev->rx_broadcast &= ~self;
+    group->members |= self;
+    file->group = group;
+    spin_unlock_irqrestore(&dev->int_in_lock, flags);
+    return 0;
+}
+
+// Update the bit of a reader in the mask of the readers having filters.
+//   Called with int_in_lock held.
+static void nr_file_filtered(struct nr_file *file)
+{
+    if (file->filter || file->prog)
+        file->dev->rx_filtered |= BIT_ULL(file->rx_id);
+    else
+        file->dev->rx_filtered &= ~BIT_ULL(file->rx_id);
+}
+
+// Build the acceptance filters from id/mask pairs and a list of identifiers,
+//   returns NULL (with *err at 0) when both are empty.
+static struct nr_filter *nr_filter_build(const struct nr_can_filter *masks,
+                                         unsigned int n_masks, const u32 *ids,
+                                         unsigned int n_ids, int *err)
+{
+    struct nr_filter *filter;
+    unsigned int i, h, size;
+
+    *err = 0;
+    if (n_masks > NR_MAX_MASK_FILTERS || n_ids > NR_MAX_ID_FILTERS)
+    {
+        *err = -EINVAL;
+        return NULL;
+    }
+    if (n_masks == 0 && n_ids == 0)
+        return NULL;
+
+    size = n_ids ? roundup_pow_of_two(2 * n_ids) : 0;
+    filter = kvzalloc(struct_size(filter, ids, size), GFP_KERNEL);
+    if (!filter)
+    {
+        *err = -ENOMEM;
+        return NULL;
+    }
+    filter->n_masks = n_masks;
+    memcpy(filter->masks, masks, n_masks * sizeof(struct nr_can_filter));
+    if (size == 0)
+        return filter;
+
+    filter->ids_bits = ilog2(size);
+    memset(filter->ids, 0xff, size * sizeof(u32));
+    for (i = 0; i < n_ids; ++i)
+    {
+        // only the identifiers nr_frame_can_id() can give, which also keeps
+        //   NR_FILTER_EMPTY out of the table
+        if (ids[i] & ~(NR_CAN_EFF_FLAG | 0x1fffffffU) ||
+            (!(ids[i] & NR_CAN_EFF_FLAG) && ids[i] > 0x7ff))
+        {
+            *err = -EINVAL;
+            kvfree(filter);
+            return NULL;
+        }
+        for (h = hash_32(ids[i], filter->ids_bits);
+             filter->ids[h] != NR_FILTER_EMPTY && filter->ids[h] != ids[i];
+             h = (h + 1) & (size - 1))
+            ;
+        if (filter->ids[h] == NR_FILTER_EMPTY)
+        {
+            filter->ids[h] = ids[i];
+            filter->n_ids++;
+        }
+    }
+    return filter;
+}
+
+// Build the acceptance filters described by a NR_IOC_SET_FILTER request,
+//   returns NULL (with *err at 0) for an empty one.
+static struct nr_filter *nr_filter_create(const struct nr_filter_req *req,
+                                          int *err)
+{
+    struct nr_filter *filter = NULL;
+    struct nr_can_filter *masks = NULL;
+    u32 *ids = NULL;
+
+    *err = 0;
+    if (req->n_masks > NR_MAX_MASK_FILTERS || req->n_ids > NR_MAX_ID_FILTERS)
+    {
+        *err = -EINVAL;
+        return NULL;
+    }
+
+    // the lists of the program, copied before being turned into tables
+    if (req->n_masks)
+    {
+        masks = memdup_user(u64_to_user_ptr(req->masks),
+                            req->n_masks * sizeof(struct nr_can_filter));
+        if (IS_ERR(masks))
+        {
+            *err = PTR_ERR(masks);
+            masks = NULL;
+            goto exit;
+        }
+    }
+    if (req->n_ids)
+    {
+        ids = memdup_user(u64_to_user_ptr(req->ids), req->n_ids * sizeof(u32));
+        if (IS_ERR(ids))
+        {
+            *err = PTR_ERR(ids);
+            ids = NULL;
+            goto exit;
+        }
     }
-    dev->len_in_buffer = urb->actual_length;
-    dev->ongoing_read = false;
 
-    // wake the queue sleeping in the read function
-    wake_up_interruptible(&dev->int_in_wait);
+    filter = nr_filter_build(masks, req->n_masks, ids, req->n_ids, err);
+exit:
+    kfree(masks);
+    kfree(ids);
+    return filter;
+}
+
+// Replace the acceptance filters of a reader.
+static int nr_set_filter(struct nr_file *file, const struct nr_filter_req *req)
+{
+    struct usb_nr *dev = file->dev;
+    struct nr_filter *filter, *old;
+    unsigned long flags;
+    int err;
+
+    if (file->rx_id < 0)
+        return -EBADF;
+    filter = nr_filter_create(req, &err);
+    if (err)
+        return err;
+
+    // the completion handler uses the filters with the lock held, the old
+    //   ones can be freed once it is released
+    spin_lock_irqsave(&dev->int_in_lock, flags);
+    old = file->filter;
+    file->filter = filter;
+    nr_file_filtered(file);
+    spin_unlock_irqrestore(&dev->int_in_lock, flags);
+
+    kvfree(old);
+    return 0;
+}
+
+// Check a classic BPF program given to NR_IOC_SET_BPF, called by
+//   bpf_prog_create_from_user() once the program has been checked as a socket
+//   filter. It runs on the 64 bytes of the report rather than on a socket
+//   buffer: as with seccomp, the absolute loads become loads from the context
+//   (the report), which have to be aligned 32 bits words, and the length of
+//   the packet is NR_FRAME_SIZE. Everything that needs a socket buffer
+//   (indirect loads, byte and half word loads, extensions) is refused.
+static int nr_bpf_check(struct sock_filter *filter, unsigned int flen)
+{
+    unsigned int i;
+
+    for (i = 0; i < flen; ++i)
+    {
+        struct sock_filter *insn = &filter[i];
+
+        switch (insn->code)
+        {
+        case BPF_LD | BPF_W | BPF_ABS:
+            if (insn->k >= NR_FRAME_SIZE || insn->k & 3)
+                return -EINVAL;
+            insn->code = BPF_LDX | BPF_W | BPF_ABS;
+            break;
+        case BPF_LD | BPF_W | BPF_LEN:
+            insn->code = BPF_LD | BPF_IMM;
+            insn->k = NR_FRAME_SIZE;
+            break;
+        case BPF_LDX | BPF_W | BPF_LEN:
+            insn->code = BPF_LDX | BPF_IMM;
+            insn->k = NR_FRAME_SIZE;
+            break;
+        case BPF_RET | BPF_K:
+        case BPF_RET | BPF_A:
+        case BPF_ALU | BPF_ADD | BPF_K:
+        case BPF_ALU | BPF_ADD | BPF_X:
+        case BPF_ALU | BPF_SUB | BPF_K:
+        case BPF_ALU | BPF_SUB | BPF_X:
+        case BPF_ALU | BPF_MUL | BPF_K:
+        case BPF_ALU | BPF_MUL | BPF_X:
+        case BPF_ALU | BPF_DIV | BPF_K:
+        case BPF_ALU | BPF_DIV | BPF_X:
+        case BPF_ALU | BPF_AND | BPF_K:
+        case BPF_ALU | BPF_AND | BPF_X:
+        case BPF_ALU | BPF_OR | BPF_K:
+        case BPF_ALU | BPF_OR | BPF_X:
+        case BPF_ALU | BPF_XOR | BPF_K:
+        case BPF_ALU | BPF_XOR | BPF_X:
+        case BPF_ALU | BPF_LSH | BPF_K:
+        case BPF_ALU | BPF_LSH | BPF_X:
+        case BPF_ALU | BPF_RSH | BPF_K:
+        case BPF_ALU | BPF_RSH | BPF_X:
+        case BPF_ALU | BPF_NEG:
+        case BPF_LD | BPF_IMM:
+        case BPF_LDX | BPF_IMM:
+        case BPF_MISC | BPF_TAX:
+        case BPF_MISC | BPF_TXA:
+        case BPF_LD | BPF_MEM:
+        case BPF_LDX | BPF_MEM:
+        case BPF_ST:
+        case BPF_STX:
+        case BPF_JMP | BPF_JA:
+        case BPF_JMP | BPF_JEQ | BPF_K:
+        case BPF_JMP | BPF_JEQ | BPF_X:
+        case BPF_JMP | BPF_JGE | BPF_K:
+        case BPF_JMP | BPF_JGE | BPF_X:
+        case BPF_JMP | BPF_JGT | BPF_K:
+        case BPF_JMP | BPF_JGT | BPF_X:
+        case BPF_JMP | BPF_JSET | BPF_K:
+        case BPF_JMP | BPF_JSET | BPF_X:
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// Replace the filter program of a reader (remove it when req->len is 0).
+static int nr_set_bpf(struct nr_file *file, const struct nr_bpf_req *req)
+{
+    struct usb_nr *dev = file->dev;
+    struct bpf_prog *prog = NULL, *old;
+    struct sock_fprog fprog;
+    unsigned long flags;
+    int err;
+
+    if (file->rx_id < 0)
+        return -EBADF;
+    if (req->len)
+    {
+        fprog.len = req->len;
+        fprog.filter = u64_to_user_ptr(req->filter);
+        err = bpf_prog_create_from_user(&prog, &fprog, nr_bpf_check, false);
+        if (err)
+            return err;
+    }
+
+    spin_lock_irqsave(&dev->int_in_lock, flags);
+    old = file->prog;
+    file->prog = prog;
+    nr_file_filtered(file);
+    spin_unlock_irqrestore(&dev->int_in_lock, flags);
+
+    if (old)
+        bpf_prog_destroy(old);
+    return 0;
 }
 
 //                           READ
@@ -256,11 +1433,12 @@ static void nr_read_int_callback(struct urb *urb)
 //  nonnegative return value represents the number of bytes successfully read
 //  (the return value is a “signed size” type, usually the native integer type
 //  for the target platform).
-//  filp is the file pointer and count is the size of the requested data
-//  transfer. The buff argument points to the user buffer holding the data to be
-//  written or the empty buffer where the newly read data should be placed.
-//  Finally, ppos is a pointer to a “long offset type” object that indicates the
-//  file position the user is accessing
+//  The driver implements read_iter rather than read: iocb describes the
+//  request (the file pointer, the file position the user is accessing and
+//  flags such as IOCB_NOWAIT) and the iov_iter "to" describes the user
+//  buffers where the newly read data should be placed, one single buffer for
+//  read(), several for readv(), or buffers handed over by io_uring. Its size
+//  is the size of the requested data transfer.
 //
 //  The return value for read is interpreted by the calling application program:
 //      If the value equals the count argument passed to the read system call,
@@ -277,8 +1455,15 @@ static void nr_read_int_callback(struct urb *urb)
 //          error was, according to <linux/errno.h>. Typical values returned on
 //          error include -EINTR (interrupted system call) or -EFAULT (bad
 //          address).
-static ssize_t nr_read(struct file *filp, char *buffer, size_t count,
-                       loff_t *ppos)
+// All the frames waiting in the receive ring are given back by a single read()
+//  as long as they fit in count: each frame keeps its own bytes, frames are
+//  never split between two calls, and a frame shorter than NR_FRAME_SIZE always
+//  ends the batch, so the program can cut the buffer every NR_FRAME_SIZE bytes.
+//  Only a first frame larger than count is truncated.
+// Once a clock has been chosen with NR_IOC_SET_RX_TSTAMP, each frame is
+//  preceded by a struct nr_rx_header telling its length and when it arrived,
+//  so short frames do not end the batch any more (see nr_driver.h).
+static ssize_t nr_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     // to return the number of readed bytes
     ssize_t rs = 0;
@@ -286,200 +1471,704 @@ static ssize_t nr_read(struct file *filp, char *buffer, size_t count,
     // define a pointer over a device struct (usb_ur)
     struct usb_nr *dev = NULL;
 
+    // the state of this open file, with our cursor in the receive ring
+    struct nr_file *file = iocb->ki_filp->private_data;
+
+    // local copy of the received frame, copy_to_user() may sleep so it can
+    //   not be called with the ring lock held
+    unsigned char frame[NR_FRAME_SIZE];
+    struct nr_rx_header hdr;
+    ssize_t len;
+    size_t room, n;
+
+    // clock of the headers, and their size (0 when there is none)
+    unsigned int tstamp = READ_ONCE(file->rx_tstamp);
+    size_t hlen = tstamp == NR_TSTAMP_NONE ? 0 : sizeof(hdr);
+
+    // number of bytes already copied to the user buffer
+    size_t copied = 0;
+
+    // size of the requested data transfer
+    size_t count = iov_iter_count(to);
+
+    // time of the call, for the latency histogram
+    ktime_t start = ktime_get();
+
     // recover our data pointer from the open file structure (saved inside
     //  the open() function )
-    dev = filp->private_data;
+    dev = file->dev;
+    trace_nr_read_enter(count, nr_nowait(iocb));
+
+    // nothing to copy: return at once, without waiting nor taking a frame
+    if (count == 0)
+        goto exit;
+
+    // with the headers, the frames are never truncated: the buffer has to
+    //   hold at least one whole record
+    if (hlen && count < hlen + NR_FRAME_SIZE)
+    {
+        rs = -EINVAL;
+        goto exit;
+    }
 
 retry:
-    // first we need to test if an urb hasn't already been submit (and not
-    //     finished yet)
-    if (dev->ongoing_read)
-    {
-        // An urb has already been sent,
-        //   we have to (legend) wait for it (dary)
-
-        // The process is put to sleep until the condition evaluates to true or a
-        //   signal is received. The condition is checked each time the waitqueue
-        //   is woken up. wake_up() has to be called after changing any variable
-        //   that could change the result of the wait condition
-        rs = wait_event_interruptible(dev->int_in_wait, (!dev->ongoing_read));
-        if (rs < 0)
-        {
-            pr_err("_NR_ %s - rs=%d, error while waiting\n", __func__, (int)rs);
-            goto exit;
-        }
+    // the frames received before the device was unplugged can still be read
+    if (READ_ONCE(dev->disconnected) && nr_rx_empty(file))
+    {
+        rs = -ENODEV;
+        goto exit;
+    }
+
+    // a file opened with O_NONBLOCK (or an io_uring/IOCB_NOWAIT request) never
+    //   sleeps: -EAGAIN tells the program to come back later (typically when
+    //   poll() reports EPOLLIN)
+    if (nr_nowait(iocb) && nr_rx_empty(file))
+    {
+        rs = -EAGAIN;
+        goto exit;
     }
-    // if we are here, it means no urb is being processed. We have to check if
-    //   one has been (if we have read some data)
-    if (dev->len_in_buffer > 0)
+
+    // The IN urbs are always in flight (see probe()), we only have to wait for
+    //   the completion handler to queue a frame in the ring.
+    // The process is put to sleep until the condition evaluates to true or a
+    //   signal is received. The condition is checked each time the waitqueue
+    //   is woken up. wake_up() has to be called after changing any variable
+    //   that could change the result of the wait condition
+    rs = wait_event_interruptible(file->rx_wait,
+                                  !nr_rx_empty(file) ||
+                                  READ_ONCE(dev->disconnected));
+    if (rs < 0)
     {
+        pr_err("_NR_ %s - rs=%d, error while waiting\n", __func__, (int)rs);
+        goto exit;
+    }
 
-        // Copy a block of data into user space.
-        //   Returns number of bytes that could not be
-        rs = copy_to_user(buffer, dev->int_in_buffer, dev->len_in_buffer);
+    len = 0;
+    while (count - copied > hlen)
+    {
+        // the first frame is always taken (and truncated if needed), the next
+        //   ones only if they fit
+        room = count - copied - hlen;
+        len = nr_rx_take(file, frame, copied ? room : NR_FRAME_SIZE, &hdr);
+        if (len < 0)
+            break;
+        n = min_t(size_t, len, room);
+
+        // the header tells the length of the frame that follows it, the
+        //   timestamp has been taken on the monotonic clock
+        if (hlen)
+        {
+            hdr.len = n;
+            if (tstamp == NR_TSTAMP_BOOTTIME)
+                hdr.tstamp = ktime_to_ns(ktime_mono_to_any(
+                    ns_to_ktime(hdr.tstamp), TK_OFFS_BOOT));
+            else if (tstamp == NR_TSTAMP_REALTIME)
+                hdr.tstamp = ktime_to_ns(ktime_mono_to_any(
+                    ns_to_ktime(hdr.tstamp), TK_OFFS_REAL));
+            if (copy_to_iter(&hdr, hlen, to) != hlen)
+            {
+                rs = -EFAULT;
+                break;
+            }
+        }
 
-        // Whatever the amount of data the method transfers, it should generally
-        //   update the file position at *ppos to represent the current file
-        //   position after successful completion of the system call. The kernel
-        //   then propagates the file position change back into the file
-        //   structure when appropriate.
-        *ppos += dev->len_in_buffer - rs;
+        // Copy a block of data into user space, frames spread over the
+        //   buffers of a readv() one after the other.
+        //   Returns number of bytes that could be copied
+        if (copy_to_iter(frame, n, to) != n)
+        {
+            rs = -EFAULT;
+            break;
+        }
+        copied += hlen + n;
 
-        // See the return value in the comments at the beginning of the function
-        rs = dev->len_in_buffer - rs;
-        dev->len_in_buffer = 0;
-        goto exit;
+        // without the headers a short frame ends the batch, see the comments
+        //   above
+        if (!hlen && len < NR_FRAME_SIZE)
+            break;
     }
-    // if we are here, it means no urb is being processed and no data has been
-    //   read, we need to send a new urb
-    // The function usb_fill_int_urb is a helper function to properly initialize
-    //   a urb to be sent to an interrupt endpoint of a USB device:
-    usb_fill_int_urb(
-        // urb* : A pointer to the urb to be initialized.
-        dev->int_in_urb,
-
-        // usb_device* : The USB device to which this urb is to be sent.
-        dev->usbdev,
-
-        // unsigned int : The specific endpoint of the USB device to which
-        //   this urb is to be sent. This value is created with the
-        //   previously mentioned usb_sndintpipe or usb_rcvintpipe functions.
-        //       usb_rcvintpipe() specifies an interrupt IN endpoint for the
-        //       specified USB device with the specified endpoint number.
-        usb_rcvintpipe(dev->usbdev,
-                       dev->int_in_endpoint->bEndpointAddress),
-
-        // A pointer to the buffer from which outgoing data is taken or
-        //   into which incoming data is received. Note that this can not
-        //   be a static buffer and must be created with a call to kmalloc.
-        dev->int_in_buffer,
-
-        // The length of the buffer pointed to by the transfer_buffer pointer
-        dev->int_in_endpoint->wMaxPacketSize,
-
-        // usb_complete_t : Pointer to the completion handler that is called
-        //   when this urb is completed.
-        nr_read_int_callback,
-
-        // void * : Pointer to the blob that is added to the urb structure
-        //   for later retrieval by the completion handler function.
-        dev,
-
-        // int : The interval at which that this urb should be scheduled.
-        dev->int_in_endpoint->bInterval);
-    rs = usb_submit_urb(dev->int_in_urb, GFP_KERNEL);
-    if (rs < 0)
+
+    if (copied == 0)
     {
-        pr_err("_NR_ %s - failed submitting urb, error %d\n", __func__,
-               (int)rs);
+        // nothing could be given back to the user space
+        if (rs < 0)
+            goto exit;
+
+        // a thread sharing this file descriptor took the frames before us
+        if (len == -EAGAIN)
+            goto retry;
+        rs = len < 0 ? len : -EINVAL;
         goto exit;
     }
-    // an urb request has been submitted and is not over yet
-    dev->ongoing_read = true;
 
-    // we need to wait for the urb to be processed
-    goto retry;
+    // Whatever the amount of data the method transfers, it should generally
+    //   update the file position at ki_pos to represent the current file
+    //   position after successful completion of the system call. The kernel
+    //   then propagates the file position change back into the file
+    //   structure when appropriate.
+    iocb->ki_pos += copied;
+
+    nr_hist_add(&dev->hist_read, start, ktime_get());
+
+    // See the return value in the comments at the beginning of the function
+    rs = copied;
 exit:
+    trace_nr_read_exit(rs);
     return rs;
 }
 
+// the transmit ring is drained by the completion handler, see below
+static void nr_tx_ring_drain(struct usb_nr *dev);
+
 // The completion handler function that is called by the USB core when
 //   the urb is completely transferred or when an error occurs to the urb. Within
 //   this function, the USB driver may inspect the urb, free it, or resubmit it
 //   for another transfer.
 static void nr_write_int_callback(struct urb *urb)
 {
+    struct nr_urb *ctx = urb->context;
     struct usb_nr *dev;
-    dev = urb->context;
-    // sync/async unlink faults aren't errors
-    if (urb->status)
+    unsigned long flags;
+    bool drain = true;
+    ktime_t now = ktime_get();
+
+    dev = ctx->dev;
+    trace_nr_urb_complete(urb);
+    atomic_long_inc(&dev->stats.tx_urbs_completed);
+    nr_count_status(dev->stats.tx_status, urb->status);
+    if (urb->status == 0)
+    {
+        atomic_long_inc(&dev->stats.tx_frames);
+        atomic_long_add(urb->actual_length, &dev->stats.tx_bytes);
+        nr_hist_add(&dev->hist_tx_urb, ctx->submitted, now);
+        if (ctx->call_start)
+            nr_hist_add(&dev->hist_write, ctx->call_start, now);
+    }
+    ctx->call_start = 0;
+
+    spin_lock_irqsave(&dev->int_out_lock, flags);
+    switch (urb->status)
+    {
+    case 0:
+        break;
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+        // sync/async unlink faults aren't errors, but the urbs are being
+        //   killed: the frames of the ring wait for the next doorbell
+        drain = false;
+        break;
+    default:
+        // the ring is drained from here, a device that keeps failing must
+        //   not log once per frame
+        dev_err_ratelimited(&dev->usbdev->dev,
+                            "_NR_ %s - nonzero write interuption status "
+                            "received: %d\n", __func__, urb->status);
+        // reported to the file that wrote the frame only
+        if (ctx->owner)
+            ctx->owner->tx_error = urb->status;
+        else
+            dev->tx_error = urb->status;
+        atomic_long_inc(&dev->stats.tx_errors);
+
+        // the device does not answer any more (as for the IN urbs): the next
+        //   frames of the ring would fail the same way
+        if (urb->status == -EPROTO ||
+            urb->status == -EILSEQ ||
+            urb->status == -ETIME)
+            drain = false;
+        break;
+    }
+    if (ctx->owner)
+    {
+        ctx->owner->tx_inflight--;
+        ctx->owner = NULL;
+    }
+    spin_unlock_irqrestore(&dev->int_out_lock, flags);
+
+    // the frame sent by the network interface goes back to the local sockets,
+    //   before the urb (and so its echo slot) can be used again
+    if (dev->netdev)
+        nr_can_tx_done(dev, urb);
+
+    // the urb (and its buffer) can be used again by write()
+    spin_lock_irqsave(&dev->int_out_lock, flags);
+    dev->tx_free[dev->tx_free_count++] = urb;
+    spin_unlock_irqrestore(&dev->int_out_lock, flags);
+    if (dev->netdev)
+        nr_can_tx_wake(dev);
+
+    // the frames queued in the transmit ring in the meantime go first
+    if (drain)
+        nr_tx_ring_drain(dev);
+
+    // wake the queue sleeping in the write function, and in flush() (which
+    //   does not sleep interruptibly)
+    wake_up(&dev->int_out_wait);
+}
+
+// take an urb from the transmit pool, NULL if they are all in flight or if
+//   the device has been unplugged (disconnect() is about to free them)
+static struct urb *nr_get_tx_urb(struct usb_nr *dev)
+{
+    struct urb *urb = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->int_out_lock, flags);
+    if (dev->tx_free_count > 0 && !dev->disconnected)
+        urb = dev->tx_free[--dev->tx_free_count];
+    spin_unlock_irqrestore(&dev->int_out_lock, flags);
+    return urb;
+}
+
+// Empty the transmit pool if every urb is back in it, returns false if some
+//   are still in flight or held by write(). Checked and emptied in one step:
+//   an urb taken in between would be freed under its holder.
+static bool nr_close_tx_pool(struct usb_nr *dev)
+{
+    bool closed;
+
+    spin_lock_irq(&dev->int_out_lock);
+    closed = dev->tx_free_count == dev->n_out_urbs;
+    if (closed)
+        dev->tx_free_count = 0;
+    spin_unlock_irq(&dev->int_out_lock);
+    return closed;
+}
+
+// give back to the pool an urb that has not been submitted
+static void nr_put_tx_urb(struct usb_nr *dev, struct urb *urb)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->int_out_lock, flags);
+    dev->tx_free[dev->tx_free_count++] = urb;
+    spin_unlock_irqrestore(&dev->int_out_lock, flags);
+    // disconnect() waits (not interruptibly) for every urb to be back
+    wake_up(&dev->int_out_wait);
+}
+
+// Send the frames of the transmit ring, from tx_tail to the head published by
+//   the program, as long as urbs of the pool are available. Called by the
+//   doorbell ioctl and by the completion handler each time an urb comes back,
+//   so a ring kept busy by the program is drained without system calls.
+//   Everything is done under int_out_lock, which also keeps the frames in
+//   order when the doorbell and a completion race.
+static void nr_tx_ring_drain(struct usb_nr *dev)
+{
+    struct nr_ring_slot *slot;
+    struct urb *urb;
+    unsigned long flags;
+    unsigned int head, len;
+    int rs;
+
+    spin_lock_irqsave(&dev->int_out_lock, flags);
+    // the acquire pairs with the release of the program: the slots up to
+    //   head are filled
+    head = smp_load_acquire(&dev->tx_ring->head);
+
+    // the head lives in a page the user space can write, never trust it: a
+    //   head more than a ring ahead can not be sent, skip to it
+    if (head - dev->tx_tail > dev->tx_ring_size)
+    {
+        dev->tx_ring_overruns += head - dev->tx_tail;
+        trace_nr_overflow(false, -1, head - dev->tx_tail);
+        dev->tx_tail = head;
+    }
+
+    while (dev->tx_tail != head && dev->tx_free_count > 0)
+    {
+        urb = dev->tx_free[--dev->tx_free_count];
+        slot = &dev->tx_slots[dev->tx_tail & (dev->tx_ring_size - 1)];
+        len = min_t(unsigned int, READ_ONCE(slot->len),
+                    dev->int_out_endpoint->wMaxPacketSize);
+        memcpy(urb->transfer_buffer, slot->data, len);
+        urb->transfer_buffer_length = len;
+        dev->tx_tail++;
+
+        rs = nr_submit_out_urb(dev, urb, GFP_ATOMIC);
+        if (rs)
+        {
+            // the frame is lost, reported like a failed write()
+            dev->tx_free[dev->tx_free_count++] = urb;
+            dev->tx_ring_overruns++;
+            trace_nr_overflow(false, -1, 1);
+            dev->tx_error = rs;
+            break;
+        }
+    }
+
+    // the release makes sure we are done with the slots before the program
+    //   sees them free
+    smp_store_release(&dev->tx_ring->tail, dev->tx_tail);
+    WRITE_ONCE(dev->tx_ring->overruns, (__u32)dev->tx_ring_overruns);
+    spin_unlock_irqrestore(&dev->int_out_lock, flags);
+}
+
+// return (and forget) the error of the last frame of the transmit ring that
+//   could not be sent
+static int nr_take_tx_error(struct usb_nr *dev)
+{
+    unsigned long flags;
+    int retval;
+
+    spin_lock_irqsave(&dev->int_out_lock, flags);
+    retval = dev->tx_error;
+    dev->tx_error = 0;
+    spin_unlock_irqrestore(&dev->int_out_lock, flags);
+    return retval;
+}
+
+// return (and forget) the error of the last frame written by a file that
+//   could not be sent
+static int nr_take_file_tx_error(struct nr_file *file)
+{
+    unsigned long flags;
+    int retval;
+
+    spin_lock_irqsave(&file->dev->int_out_lock, flags);
+    retval = file->tx_error;
+    file->tx_error = 0;
+    spin_unlock_irqrestore(&file->dev->int_out_lock, flags);
+    return retval;
+}
+
+// make a file the owner of an OUT urb (NULL to give it up if the urb could
+//   not be submitted), before the submission: the completion may run before
+//   usb_submit_urb() returns
+static void nr_set_tx_owner(struct urb *urb, struct nr_file *file)
+{
+    struct nr_urb *ctx = urb->context;
+    struct usb_nr *dev = ctx->dev;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->int_out_lock, flags);
+    if (file)
+        file->tx_inflight++;
+    else if (ctx->owner)
+        ctx->owner->tx_inflight--;
+    ctx->owner = file;
+    spin_unlock_irqrestore(&dev->int_out_lock, flags);
+}
+
+// Queue one frame of len bytes (at most wMaxPacketSize) taken from the user
+//   buffers: take an urb from the pool, waiting for one unless nowait is set,
+//   fill it and submit it on behalf of file. Returns 0 or an error.
+static int nr_write_frame(struct nr_file *file, bool nowait,
+                          struct iov_iter *from, size_t len, ktime_t start)
+{
+    struct usb_nr *dev = file->dev;
+    struct urb *urb = NULL;
+    int retval = 0;
+
+    // same as in read(), a non-blocking request gets -EAGAIN instead of
+    //   waiting for an urb to come back in the pool
+    if (nowait)
+    {
+        urb = nr_get_tx_urb(dev);
+        if (!urb)
+        {
+            retval = -EAGAIN;
+            goto error;
+        }
+    }
+    else
+    {
+        // wait for an urb of the pool to be available, they are given back by
+        //   the completion handler
+        retval = wait_event_interruptible(dev->int_out_wait,
+                                          (urb = nr_get_tx_urb(dev)) != NULL ||
+                                          READ_ONCE(dev->disconnected));
+        if (retval < 0)
+        {
+            pr_err("_NR_ %s - rs=%d, error while waiting\n", __func__,
+                   (int)retval);
+            goto error;
+        }
+    }
+
+    // the device has been unplugged while we were waiting
+    if (READ_ONCE(dev->disconnected))
+    {
+        retval = -ENODEV;
+        goto error;
+    }
+
+    // get the data from the user space
+    if (copy_from_iter(urb->transfer_buffer, len, from) != len)
+    {
+        pr_err("_NR_ %s - getting data from the user space", __func__);
+        retval = -EFAULT;
+        goto error;
+    }
+
+    // the urb has been initialized in probe(), only the length of the frame
+    //   changes from one write to another
+    urb->transfer_buffer_length = len;
+
+    // for the write() latency histogram, counted by the completion handler
+    ((struct nr_urb *)urb->context)->call_start = start;
+    nr_set_tx_owner(urb, file);
+
+    retval = nr_submit_out_urb(dev, urb, GFP_KERNEL);
+    if (retval)
+    {
+        pr_err("_NR_ %s - error submitting the urb", __func__);
+        ((struct nr_urb *)urb->context)->call_start = 0;
+        nr_set_tx_owner(urb, NULL);
+        goto error;
+    }
+    return 0;
+error:
+    if (urb)
+        nr_put_tx_urb(dev, urb);
+    return retval;
+}
+
+//                           WRITE
+//------------------------------------------------------------
+// write, like read, can transfer less data than was requested, according to the
+//  following rules for the return value:
+//      If the value equals count , the requested number of bytes has been
+//          transferred.
+//      If the value is positive, but smaller than count , only part of the data
+//          has been transferred. The program will most likely retry writing the
+//          rest of the data.
+//      If the value is 0 , nothing was written. This result is not an error,
+//          and there is no reason to return an error code. Once again, the
+//          standard library retries the call to write.
+//      A negative value means an error occurred; as for read, valid error
+//          values are those defined in <linux/errno.h
+// The frames are only queued: write() returns as soon as their urbs are
+//   submitted and the urbs complete in the background, so several frames can
+//   be on the wire at once. A transfer error is reported by the following
+//   write() call.
+// A write of more than wMaxPacketSize bytes is a batch of whole frames, each
+//   one sent in its own urb. If the pool runs dry in the middle of a batch,
+//   a blocking write() waits for urbs to come back while a non-blocking one
+//   returns the number of bytes already queued.
+static ssize_t nr_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+
+    // define a pointer over a device struct (usb_ur)
+    struct usb_nr *dev = NULL;
+
+    // the open file writing, which gets the errors of its own frames only
+    struct nr_file *file = iocb->ki_filp->private_data;
+
+    // time of the call, for the latency histogram
+    ktime_t start = ktime_get();
+
+    // size of a frame
+    size_t maxp;
+
+    // number of bytes already queued
+    size_t queued = 0;
+
+    // size of the data to send, possibly spread over several buffers
+    //   (writev())
+    size_t count = iov_iter_count(from);
+
+    int retval = 0;
+    ssize_t rs;
+
+    // recover our data pointer from the open file structure (saved inside
+    //  the open() function )
+    dev = file->dev;
+    maxp = dev->int_out_endpoint->wMaxPacketSize;
+    trace_nr_write_enter(count, nr_nowait(iocb));
+
+    if (count <= 0 || (count > maxp && count % maxp))
     {
-        if (!(urb->status == -ENOENT ||
-              urb->status == -ECONNRESET ||
-              urb->status == -ESHUTDOWN))
-            pr_err("_NR_ %s - nonzero write interuption status received: %d\n",
-                   __func__, urb->status);
+        // verify that we want to send a correct amount of data
+        //	(the lenght data that have to be send to our usb device): up to
+        //	one frame, or a whole number of frames
+        pr_err("_NR_ %s - not or too many data to send", __func__);
+        rs = -EINVAL;
+        goto exit;
     }
-    dev->outgoing_write = false;
 
-    // wake the queue sleeping in the write function
-    wake_up_interruptible(&dev->int_out_wait);
+    if (READ_ONCE(dev->disconnected))
+    {
+        rs = -ENODEV;
+        goto exit;
+    }
+
+    // a previous frame of this file could not be sent
+    rs = nr_take_file_tx_error(file);
+    if (rs)
+        goto exit;
+
+    while (queued < count)
+    {
+        retval = nr_write_frame(file, nr_nowait(iocb), from,
+                                min(count - queued, maxp), start);
+        if (retval)
+            break;
+        queued += min(count - queued, maxp);
+    }
+
+    // the frames already queued will be sent, they have to be accounted for
+    //   even if the next one failed
+    rs = queued > 0 ? queued : retval;
+exit:
+    trace_nr_write_exit(rs);
+    return rs;
+}
+
+//                           FLUSH
+//------------------------------------------------------------
+// Called each time a file descriptor is closed (close() system call), before
+//  release. As write() does not wait for its frames to be sent, this is where
+//  a program gets a last chance to see that they were (or were not). Only the
+//  frames of this file are waited for, not those of the other writers.
+static int nr_flush(struct file *filp, fl_owner_t id)
+{
+    struct nr_file *file = filp->private_data;
+    struct usb_nr *dev = file->dev;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return 0;
+
+    // give the urbs in flight some time to complete
+    if (!wait_event_timeout(dev->int_out_wait,
+                            READ_ONCE(file->tx_inflight) == 0 ||
+                            READ_ONCE(dev->disconnected),
+                            msecs_to_jiffies(NR_FLUSH_TIMEOUT_MS)))
+        return -ETIMEDOUT;
+
+    return nr_take_file_tx_error(file);
+}
+
+//                           POLL
+//------------------------------------------------------------
+// Back end of the poll, select and epoll system calls: it tells if a read or a
+//  write would block. poll_wait() registers the wait queues that will be woken
+//  up when the answer may change (by the completion handlers), it does not
+//  sleep itself.
+//      EPOLLIN | EPOLLRDNORM: a frame this reader has not read yet is waiting
+//          in the receive ring
+//      EPOLLOUT | EPOLLWRNORM: an urb of the transmit pool is available
+//      EPOLLHUP | EPOLLERR: the device has been unplugged
+static __poll_t nr_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct nr_file *file = filp->private_data;
+    struct usb_nr *dev = file->dev;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &file->rx_wait, wait);
+    poll_wait(filp, &dev->int_out_wait, wait);
+
+    if (!nr_rx_empty(file))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (READ_ONCE(dev->tx_free_count) > 0)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    if (READ_ONCE(dev->disconnected))
+        mask |= EPOLLHUP | EPOLLERR;
+
+    return mask;
 }
 
-//                           WRITE
+//                           MMAP
 //------------------------------------------------------------
-// write, like read, can transfer less data than was requested, according to the
-//  following rules for the return value:
-//      If the value equals count , the requested number of bytes has been
-//          transferred.
-//      If the value is positive, but smaller than count , only part of the data
-//          has been transferred. The program will most likely retry writing the
-//          rest of the data.
-//      If the value is 0 , nothing was written. This result is not an error,
-//          and there is no reason to return an error code. Once again, the
-//          standard library retries the call to write.
-//      A negative value means an error occurred; as for read, valid error
-//          values are those defined in <linux/errno.h
-static ssize_t nr_write(struct file *filp, const char *buffer, size_t count,
-                        loff_t *ppos)
+// Maps the receive ring (offset NR_MMAP_RX_OFFSET) or the transmit ring (offset
+//  NR_MMAP_TX_OFFSET) in the address space of the program (see nr_driver.h for
+//  the layout and how to use them). The frames are written to and taken from
+//  there by the completion handlers, so a program using the mappings needs no
+//  system call per frame. The mapping has to be shared: the program writes one
+//  of the indexes.
+static int nr_mmap(struct file *filp, struct vm_area_struct *vma)
 {
+    struct usb_nr *dev = ((struct nr_file *)filp->private_data)->dev;
+    void *ring = dev->rx_ring;
+    unsigned long pgoff = vma->vm_pgoff - (NR_MMAP_RX_OFFSET >> PAGE_SHIFT);
 
-    // define a pointer over a device struct (usb_ur)
-    struct usb_nr *dev = NULL;
-
-    int retval = 0;
+    if (READ_ONCE(dev->disconnected))
+        return -ENODEV;
 
-    // recover our data pointer from the open file structure (saved inside
-    //  the open() function )
-    dev = filp->private_data;
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
 
-    if (count <= 0 || count > dev->int_out_endpoint->wMaxPacketSize)
+    if (vma->vm_pgoff >= (NR_MMAP_TX_OFFSET >> PAGE_SHIFT))
     {
-        // verify that we want to send a correct amount of data
-        //	(the lenght data that have to be send to our usb device)
-        pr_err("_NR_ %s - not or too many data to send", __func__);
-        retval = -EINVAL;
-        goto error;
+        ring = dev->tx_ring;
+        pgoff = vma->vm_pgoff - (NR_MMAP_TX_OFFSET >> PAGE_SHIFT);
     }
-
-    // get the data from the user space
-    if (copy_from_user(dev->int_out_buffer, buffer, count))
+    else
     {
-        pr_err("_NR_ %s - getting data from the user space", __func__);
-        retval = -EFAULT;
-        goto error;
+        // every reader (read(), the network interface) takes its frames from
+        //   the receive ring: no program may write in it, nor mprotect() its
+        //   mapping writable later
+        if (vma->vm_flags & VM_WRITE)
+            return -EPERM;
+        vm_flags_clear(vma, VM_MAYWRITE);
     }
 
-    // initialize the urb properly (function detailed in the read() function)
-    usb_fill_int_urb(dev->int_out_urb,
-                     dev->usbdev,
-                     usb_sndintpipe(dev->usbdev,
-                                    dev->int_out_endpoint->bEndpointAddress),
-                     dev->int_out_buffer,
-                     count,
-                     nr_write_int_callback,
-                     dev,
-                     dev->int_out_endpoint->bInterval);
+    // the pages of the ring can not be swapped or copied on fork
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
 
-    dev->outgoing_write = true;
-    retval = usb_submit_urb(dev->int_out_urb, GFP_KERNEL);
-    if (retval)
-    {
-        pr_err("_NR_ %s - error submitting the urb", __func__);
-        goto error;
-    }
+    // checks that the offset and length fit in the ring
+    return remap_vmalloc_range(vma, ring, pgoff);
+}
 
-    // detailed in the read() function
-    retval = wait_event_interruptible(dev->int_out_wait,
-                                      (!dev->outgoing_write));
-    if (retval < 0)
+//                           IOCTL
+//------------------------------------------------------------
+// The ioctl system call offers a way to issue device-specific commands, the
+//  commands are defined in nr_driver.h. An unknown command gets -ENOTTY
+//  ("inappropriate ioctl for device").
+static long nr_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct nr_file *file = filp->private_data;
+    struct usb_nr *dev = file->dev;
+    struct nr_rx_stats stats;
+    struct nr_group_req group;
+    struct nr_filter_req filter;
+    struct nr_bpf_req bpf;
+    __u32 tstamp;
+    unsigned long flags;
+
+    switch (cmd)
     {
-        pr_err("_NR_ %s - rs=%d, error while waiting\n", __func__, (int)retval);
-        goto error;
+    case NR_IOC_TX_KICK:
+        if (READ_ONCE(dev->disconnected))
+            return -ENODEV;
+
+        // doorbell of the transmit ring
+        nr_tx_ring_drain(dev);
+        return nr_take_tx_error(dev);
+    case NR_IOC_GET_RX_STATS:
+        // counters of this reader, still available after an unplug
+        memset(&stats, 0, sizeof(stats));
+        spin_lock_irqsave(&dev->int_in_lock, flags);
+        stats.frames = file->rx_frames;
+        stats.overruns = file->rx_overruns;
+        stats.pending = file->rx_pending;
+        spin_unlock_irqrestore(&dev->int_in_lock, flags);
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+            return -EFAULT;
+        return 0;
+    case NR_IOC_SET_GROUP:
+        if (copy_from_user(&group, (void __user *)arg, sizeof(group)))
+            return -EFAULT;
+        return nr_set_group(file, &group);
+    case NR_IOC_SET_FILTER:
+        if (copy_from_user(&filter, (void __user *)arg, sizeof(filter)))
+            return -EFAULT;
+        return nr_set_filter(file, &filter);
+    case NR_IOC_SET_BPF:
+        if (copy_from_user(&bpf, (void __user *)arg, sizeof(bpf)))
+            return -EFAULT;
+        return nr_set_bpf(file, &bpf);
+    case NR_IOC_SET_RX_TSTAMP:
+        if (get_user(tstamp, (__u32 __user *)arg))
+            return -EFAULT;
+        if (tstamp > NR_TSTAMP_REALTIME)
+            return -EINVAL;
+        WRITE_ONCE(file->rx_tstamp, tstamp);
+        return 0;
+    default:
+        return -ENOTTY;
     }
-    return count;
-error:
-    return retval;
 }
 
 // The file_operations structure is how a char driver sets up this connection.
@@ -499,13 +2188,32 @@ static const struct file_operations nr_fops = {
     // This operation is invoked when the file structure is being released
     .release = nr_release,
 
-    // size_t (*read) (struct file *, char __user *, size_t, loff_t *);
-    //  Used to retrieve data from the device.
-    .read = nr_read,
+    // int (*flush) (struct file *, fl_owner_t id);
+    //  Invoked when a process closes its copy of a file descriptor.
+    .flush = nr_flush,
 
-    // size_t (*write) (struct file *, char __user *, size_t, loff_t *);
-    //	Used to send data to the device.
-    .write = nr_write,
+    // ssize_t (*read_iter) (struct kiocb *, struct iov_iter *);
+    //  Used to retrieve data from the device, backs read, readv and the
+    //  io_uring reads.
+    .read_iter = nr_read_iter,
+
+    // ssize_t (*write_iter) (struct kiocb *, struct iov_iter *);
+    //	Used to send data to the device, backs write, writev and the io_uring
+    //	writes.
+    .write_iter = nr_write_iter,
+
+    // __poll_t (*poll) (struct file *, struct poll_table_struct *);
+    //  Used by poll, select and epoll to know if read or write would block.
+    .poll = nr_poll,
+
+    // int (*mmap) (struct file *, struct vm_area_struct *);
+    //  Used to map the receive and transmit rings in the user space.
+    .mmap = nr_mmap,
+
+    // long (*unlocked_ioctl) (struct file *, unsigned int, unsigned long);
+    //  Device-specific commands (see nr_driver.h).
+    .unlocked_ioctl = nr_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
 // This struct usb_class_driver is used to define a number of different
@@ -541,6 +2249,458 @@ static struct usb_device_id id_table[] = {
 // then adds that information to the exported USB module device table
 MODULE_DEVICE_TABLE(usb, id_table);
 
+// Allocate a ring shared with the user space (layout in nr_driver.h): the
+//   header on the first page and the slots on the next ones. The number of
+//   frames asked for is rounded up to a power of two, the actual number of
+//   slots and size of the allocation are given back.
+static struct nr_ring_header *nr_alloc_ring(unsigned int frames,
+                                            unsigned int *size,
+                                            unsigned long *bytes)
+{
+    struct nr_ring_header *ring;
+
+    *size = roundup_pow_of_two(clamp_t(unsigned int, frames,
+                                       NR_MIN_RING, NR_MAX_RING));
+    *bytes = PAGE_SIZE + PAGE_ALIGN(*size * sizeof(struct nr_ring_slot));
+
+    // vmalloc_user() gives zeroed memory that can be mapped in user space
+    ring = vmalloc_user(*bytes);
+    if (!ring)
+        return NULL;
+
+    ring->size = *size;
+    ring->slot_size = sizeof(struct nr_ring_slot);
+    ring->data_offset = PAGE_SIZE;
+    ring->map_size = *bytes;
+    return ring;
+}
+
+//------------------------------------------------------------
+//                    SOCKETCAN FRONTEND
+//------------------------------------------------------------
+// With socketcan=1 the adapter is a CAN network interface rather than a
+//   character device: candump, cansend, can-isotp... work on it as on any
+//   other CAN controller. The interface reads the receive ring with its own
+//   cursor, from NAPI so that the frames received while the interface was
+//   scheduled reach the network stack in one batch, and sends each frame
+//   with an urb of the transmit pool.
+#if IS_ENABLED(CONFIG_CAN_DEV)
+
+// private part of the network device, struct can_priv has to come first
+struct nr_can
+{
+    struct can_priv can;
+
+    struct usb_nr *dev;
+
+    struct napi_struct napi;
+
+    // cursor of the interface in the receive ring, as the one of a reader
+    unsigned int rx_seq;
+};
+
+// rank of an OUT urb in the pool, which is also its echo slot
+static unsigned int nr_out_urb_index(struct usb_nr *dev, struct urb *urb)
+{
+    return (struct nr_urb *)urb->context - dev->out_ctx;
+}
+
+// translate a report of the adapter into a CAN frame
+static void nr_can_decode(const unsigned char *data, struct can_frame *cf)
+{
+    u32 id = nr_frame_can_id(data);
+    unsigned char dlc = data[NR_FRAME_DLC];
+
+    // NR_CAN_EFF_FLAG is CAN_EFF_FLAG
+    cf->can_id = id;
+    cf->len = can_cc_dlc2len(dlc & NR_DLC_LEN);
+    if (dlc & NR_DLC_RTR)
+        cf->can_id |= CAN_RTR_FLAG;
+    else
+        memcpy(cf->data, &data[NR_FRAME_DATA], cf->len);
+}
+
+// translate a CAN frame into a report for the adapter, laid out as the
+//   ones nrtest_write.py sends
+static void nr_can_encode(const struct can_frame *cf, unsigned char *data)
+{
+    u32 sid;
+
+    memset(data, 0, NR_FRAME_SIZE);
+    data[NR_FRAME_CMD] = NR_CMD_TX;
+    if (cf->can_id & CAN_EFF_FLAG)
+    {
+        sid = (cf->can_id & CAN_EFF_MASK) >> 18;
+        data[NR_FRAME_SIDL] = NR_SIDL_EXIDE | ((cf->can_id >> 16) & 0x03);
+        data[NR_FRAME_EID8] = cf->can_id >> 8;
+        data[NR_FRAME_EID0] = cf->can_id;
+    }
+    else
+    {
+        sid = cf->can_id & CAN_SFF_MASK;
+    }
+    data[NR_FRAME_SIDH] = sid >> 3;
+    data[NR_FRAME_SIDL] |= (sid & 0x07) << 5;
+
+    data[NR_FRAME_DLC] = cf->len;
+    if (cf->can_id & CAN_RTR_FLAG)
+        data[NR_FRAME_DLC] |= NR_DLC_RTR;
+    else
+        memcpy(&data[NR_FRAME_DATA], cf->data, cf->len);
+}
+
+// NAPI poll function: give the network stack the frames of the receive ring,
+//   at most budget of them
+static int nr_can_poll(struct napi_struct *napi, int budget)
+{
+    struct nr_can *priv = container_of(napi, struct nr_can, napi);
+    struct usb_nr *dev = priv->dev;
+    struct net_device_stats *stats = &dev->netdev->stats;
+    unsigned char data[NR_FRAME_SIZE];
+    struct can_frame *cf;
+    struct sk_buff *skb;
+    int done = 0;
+
+    while (done < budget)
+    {
+        spin_lock_irq(&dev->int_in_lock);
+        // as in nr_rx_take(), the frames overwritten before we got them are
+        //   lost
+        if (dev->rx_head - priv->rx_seq > dev->rx_ring_size)
+        {
+            stats->rx_over_errors +=
+                dev->rx_head - dev->rx_ring_size - priv->rx_seq;
+            stats->rx_errors += dev->rx_head - dev->rx_ring_size - priv->rx_seq;
+            atomic_long_add(dev->rx_head - dev->rx_ring_size - priv->rx_seq,
+                            &dev->stats.rx_overruns);
+            trace_nr_overflow(true, -1,
+                              dev->rx_head - dev->rx_ring_size - priv->rx_seq);
+            priv->rx_seq = dev->rx_head - dev->rx_ring_size;
+        }
+        if (priv->rx_seq == dev->rx_head)
+        {
+            spin_unlock_irq(&dev->int_in_lock);
+            break;
+        }
+        memcpy(data, dev->rx_slots[priv->rx_seq & (dev->rx_ring_size - 1)].data,
+               NR_FRAME_SIZE);
+        priv->rx_seq++;
+        spin_unlock_irq(&dev->int_in_lock);
+        done++;
+
+        skb = alloc_can_skb(dev->netdev, &cf);
+        if (!skb)
+        {
+            stats->rx_dropped++;
+            continue;
+        }
+        nr_can_decode(data, cf);
+        stats->rx_packets++;
+        if (!(cf->can_id & CAN_RTR_FLAG))
+            stats->rx_bytes += cf->len;
+        netif_receive_skb(skb);
+    }
+
+    // a frame received from now on schedules us again
+    if (done < budget)
+        napi_complete_done(napi, done);
+    return done;
+}
+
+// called by the IN completion handler once a frame is in the ring
+static void nr_can_rx(struct usb_nr *dev)
+{
+    struct nr_can *priv = netdev_priv(dev->netdev);
+
+    // does nothing while the interface is down (NAPI disabled)
+    napi_schedule(&priv->napi);
+}
+
+// called by the OUT completion handler before the urb goes back to the pool
+static void nr_can_tx_done(struct usb_nr *dev, struct urb *urb)
+{
+    struct net_device *netdev = dev->netdev;
+    unsigned int idx = nr_out_urb_index(dev, urb);
+
+    if (urb->status == 0)
+    {
+        netdev->stats.tx_bytes += can_get_echo_skb(netdev, idx, NULL);
+        netdev->stats.tx_packets++;
+    }
+    else
+    {
+        can_free_echo_skb(netdev, idx, NULL);
+        netdev->stats.tx_errors++;
+    }
+}
+
+// called by the OUT completion handler once the urb is back in the pool
+static void nr_can_tx_wake(struct usb_nr *dev)
+{
+    if (!READ_ONCE(dev->disconnected))
+        netif_wake_queue(dev->netdev);
+}
+
+static netdev_tx_t nr_can_start_xmit(struct sk_buff *skb,
+                                     struct net_device *netdev)
+{
+    struct nr_can *priv = netdev_priv(netdev);
+    struct usb_nr *dev = priv->dev;
+    struct urb *urb = NULL;
+    unsigned long flags;
+    unsigned int idx;
+    int retval;
+
+    if (can_dev_dropped_skb(netdev, skb))
+        return NETDEV_TX_OK;
+
+    // the queue is stopped as soon as the pool is empty, the completion
+    //   handler starts it again
+    spin_lock_irqsave(&dev->int_out_lock, flags);
+    if (dev->tx_free_count > 0)
+        urb = dev->tx_free[--dev->tx_free_count];
+    if (dev->tx_free_count == 0)
+        netif_stop_queue(netdev);
+    spin_unlock_irqrestore(&dev->int_out_lock, flags);
+    if (!urb)
+        return NETDEV_TX_BUSY;
+
+    nr_can_encode((struct can_frame *)skb->data, urb->transfer_buffer);
+    urb->transfer_buffer_length = NR_FRAME_SIZE;
+
+    // the frame is given back to the local sockets once it has been sent
+    idx = nr_out_urb_index(dev, urb);
+    can_put_echo_skb(skb, netdev, idx, 0);
+
+    retval = nr_submit_out_urb(dev, urb, GFP_ATOMIC);
+    if (retval)
+    {
+        can_free_echo_skb(netdev, idx, NULL);
+        netdev->stats.tx_dropped++;
+        if (retval == -ENODEV || retval == -EPERM)
+            netif_device_detach(netdev);
+        nr_put_tx_urb(dev, urb);
+        nr_can_tx_wake(dev);
+    }
+    return NETDEV_TX_OK;
+}
+
+static int nr_can_open(struct net_device *netdev)
+{
+    struct nr_can *priv = netdev_priv(netdev);
+    struct usb_nr *dev = priv->dev;
+    int retval;
+
+    retval = open_candev(netdev);
+    if (retval)
+        return retval;
+
+    // the interface starts with the next frame received, as a new reader
+    spin_lock_irq(&dev->int_in_lock);
+    priv->rx_seq = dev->rx_head;
+    spin_unlock_irq(&dev->int_in_lock);
+
+    napi_enable(&priv->napi);
+    priv->can.state = CAN_STATE_ERROR_ACTIVE;
+    netif_start_queue(netdev);
+    return 0;
+}
+
+static int nr_can_stop(struct net_device *netdev)
+{
+    struct nr_can *priv = netdev_priv(netdev);
+
+    netif_stop_queue(netdev);
+    napi_disable(&priv->napi);
+    priv->can.state = CAN_STATE_STOPPED;
+    close_candev(netdev);
+    return 0;
+}
+
+static const struct net_device_ops nr_can_netdev_ops = {
+    .ndo_open = nr_can_open,
+    .ndo_stop = nr_can_stop,
+    .ndo_start_xmit = nr_can_start_xmit,
+    .ndo_change_mtu = can_change_mtu,
+};
+
+// Register the network interface of the adapter, instead of the character
+//   device.
+static int nr_can_register(struct usb_interface *interface,
+                           struct usb_nr *dev)
+{
+    struct net_device *netdev;
+    struct nr_can *priv;
+    int retval;
+
+    // one echo slot per OUT urb
+    netdev = alloc_candev(sizeof(*priv), dev->n_out_urbs);
+    if (!netdev)
+    {
+        pr_err("_NR_ %s - Could not allocate the network device\n", __func__);
+        return -ENOMEM;
+    }
+    priv = netdev_priv(netdev);
+    priv->dev = dev;
+    priv->can.bittiming.bitrate = can_bitrate;
+    netdev->netdev_ops = &nr_can_netdev_ops;
+
+    // the frames sent come back to the local sockets from nr_can_tx_done()
+    netdev->flags |= IFF_ECHO;
+    SET_NETDEV_DEV(netdev, &interface->dev);
+    netif_napi_add(netdev, &priv->napi, nr_can_poll);
+
+    dev->netdev = netdev;
+    retval = register_candev(netdev);
+    if (retval)
+    {
+        pr_err("_NR_ %s - Could not register the network device\n",
+               __func__);
+        dev->netdev = NULL;
+        free_candev(netdev);
+    }
+    return retval;
+}
+
+// once the urbs are poisoned
+static void nr_can_unregister(struct usb_nr *dev)
+{
+    unregister_candev(dev->netdev);
+    free_candev(dev->netdev);
+    dev->netdev = NULL;
+}
+
+#else // !IS_ENABLED(CONFIG_CAN_DEV)
+
+static int nr_can_register(struct usb_interface *interface,
+                           struct usb_nr *dev)
+{
+    pr_err("_NR_ %s - The kernel has no CAN device support (CONFIG_CAN_DEV)\n",
+           __func__);
+    return -EOPNOTSUPP;
+}
+static void nr_can_unregister(struct usb_nr *dev) {}
+static void nr_can_rx(struct usb_nr *dev) {}
+static void nr_can_tx_done(struct usb_nr *dev, struct urb *urb) {}
+static void nr_can_tx_wake(struct usb_nr *dev) {}
+
+#endif // IS_ENABLED(CONFIG_CAN_DEV)
+
+//------------------------------------------------------------
+//                    LATENCY HISTOGRAMS
+//------------------------------------------------------------
+// Each device has a directory in debugfs named after its interface, for
+//   instance /sys/kernel/debug/nr_driver/1-1:1.0/, with one file per
+//   histogram:
+//      rx_urb: submission to completion of the IN urbs (which includes the
+//          time the adapter had nothing to send)
+//      tx_urb: submission to completion of the OUT urbs
+//      read:   call to read() to the frames given back
+//      write:  call to write() to the completion of the urb of each frame
+//   Reading a file gives the count of each bucket and the percentiles,
+//   writing anything to it clears the histogram:
+//          cat /sys/kernel/debug/nr_driver/*/tx_urb
+//          echo 0 > /sys/kernel/debug/nr_driver/1-1:1.0/tx_urb
+
+// the nr_driver directory of debugfs, created by usb_nr_init()
+static struct dentry *nr_debugfs_root;
+
+static int nr_hist_show(struct seq_file *m, void *v)
+{
+    static const unsigned int permille[] = {500, 990, 999};
+    struct nr_hist *hist = m->private;
+    long count[NR_HIST_BUCKETS];
+    long total = 0, seen;
+    unsigned int i, p;
+
+    // the completion handlers keep counting while we read
+    for (i = 0; i < NR_HIST_BUCKETS; ++i)
+    {
+        count[i] = atomic_long_read(&hist->count[i]);
+        total += count[i];
+    }
+
+    seq_printf(m, "%14s %14s %12s\n", "from_ns", "to_ns", "count");
+    for (i = 0; i < NR_HIST_BUCKETS; ++i)
+    {
+        if (count[i] == 0)
+            continue;
+        if (i == NR_HIST_BUCKETS - 1)
+            seq_printf(m, "%14llu %14s %12ld\n", 1ULL << (i - 1), "-",
+                       count[i]);
+        else
+            seq_printf(m, "%14llu %14llu %12ld\n", i ? 1ULL << (i - 1) : 0,
+                       (1ULL << i) - 1, count[i]);
+    }
+    seq_printf(m, "total %ld\n", total);
+    if (total == 0)
+        return 0;
+
+    // a percentile is given as the upper bound of the bucket it falls in
+    for (p = 0; p < ARRAY_SIZE(permille); ++p)
+    {
+        seen = 0;
+        for (i = 0; i < NR_HIST_BUCKETS - 1; ++i)
+        {
+            seen += count[i];
+            if (seen * 1000 >= total * permille[p])
+                break;
+        }
+        if (i == NR_HIST_BUCKETS - 1)
+            seq_printf(m, "p%u.%u >= %llu ns\n", permille[p] / 10,
+                       permille[p] % 10, 1ULL << (i - 1));
+        else
+            seq_printf(m, "p%u.%u < %llu ns\n", permille[p] / 10,
+                       permille[p] % 10, 1ULL << i);
+    }
+    return 0;
+}
+
+static int nr_hist_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, nr_hist_show, inode->i_private);
+}
+
+// any write clears the histogram
+static ssize_t nr_hist_write(struct file *filp, const char __user *buf,
+                             size_t count, loff_t *ppos)
+{
+    struct nr_hist *hist = ((struct seq_file *)filp->private_data)->private;
+    unsigned int i;
+
+    for (i = 0; i < NR_HIST_BUCKETS; ++i)
+        atomic_long_set(&hist->count[i], 0);
+    return count;
+}
+
+static const struct file_operations nr_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = nr_hist_open,
+    .read = seq_read,
+    .write = nr_hist_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Create the directory of a device. As everywhere else in the kernel, the
+//   errors of debugfs are not checked: the driver works the same without it.
+static void nr_debugfs_add(struct usb_interface *interface, struct usb_nr *dev)
+{
+    dev->debugfs = debugfs_create_dir(dev_name(&interface->dev),
+                                      nr_debugfs_root);
+    debugfs_create_file("rx_urb", 0600, dev->debugfs, &dev->hist_rx_urb,
+                        &nr_hist_fops);
+    debugfs_create_file("tx_urb", 0600, dev->debugfs, &dev->hist_tx_urb,
+                        &nr_hist_fops);
+    debugfs_create_file("read", 0600, dev->debugfs, &dev->hist_read,
+                        &nr_hist_fops);
+    debugfs_create_file("write", 0600, dev->debugfs, &dev->hist_write,
+                        &nr_hist_fops);
+}
+
+// undoes probe(), also called by probe() once the device is registered
+static void nr_disconnect(struct usb_interface *interface);
+
 //                           PROBE
 //------------------------------------------------------------
 // probe function
@@ -571,6 +2731,8 @@ static int nr_probe(struct usb_interface *interface,
 
     int i; // for the for loop
 
+    struct urb *urb;
+
     // Allocate memory for our device state and initialize it
     //   kzalloc — allocate memory. The memory is set to zero.
     //   GFP_KERNEL: the type of memory to allocate
@@ -581,6 +2743,9 @@ static int nr_probe(struct usb_interface *interface,
         goto error;
     }
 
+    // the reference of the interface, dropped in disconnect()
+    kref_init(&dev->kref);
+
     // get the usb_device struct from the interface, the using of usb_get_dev():
     //  https://www.kernel.org/doc/htmldocs/usb/API-usb-get-dev.html
     //   "Drivers for USB interfaces should normally record such references in
@@ -594,8 +2759,12 @@ static int nr_probe(struct usb_interface *interface,
     //   work with the same basic data type, a wait queue (wait_queue_head_t). A
     //   wait queue is a queue of processes that are waiting for an event.
     //   init_waitqueue_head initializes a wait_queue_head_t
-    init_waitqueue_head(&dev->int_in_wait);
     init_waitqueue_head(&dev->int_out_wait);
+    spin_lock_init(&dev->int_in_lock);
+    spin_lock_init(&dev->int_out_lock);
+    init_usb_anchor(&dev->int_in_anchor);
+    init_usb_anchor(&dev->int_out_anchor);
+    INIT_WORK(&dev->in_halt_work, nr_in_halt_work);
 
     // Set up interrupt endpoint information
     // A pointer into the array altsetting, denoting the currently active
@@ -613,36 +2782,11 @@ static int nr_probe(struct usb_interface *interface,
         {
             // we found the endpoint
             dev->int_in_endpoint = endpoint;
-
-            // we prepare our in buffer to be able to handle the data
-            //   exchanged througt this endpoint
-            //       endpoint->wMaxPacketSize: the maximal data
-            //       exchanged from this endpoint
-            dev->int_in_buffer = kmalloc(endpoint->wMaxPacketSize,
-                                         GFP_KERNEL);
-            if (!dev->int_in_buffer)
-            {
-                pr_err("_NR_ %s - Could not allocate int_in_buffer\n", __func__);
-                goto error;
-            }
         }
         // and the first (and only in our case) interrupt OUT endpoint
         if (!dev->int_out_endpoint && usb_endpoint_is_int_out(endpoint))
         {
             dev->int_out_endpoint = endpoint;
-
-            // we prepare our out buffer to be able to handle the data
-            //   exchanged througt this endpoint
-            //       endpoint->wMaxPacketSize: the maximal data
-            //       exchanged from this endpoint
-            dev->int_out_buffer = kmalloc(endpoint->wMaxPacketSize,
-                                          GFP_KERNEL);
-            if (!dev->int_out_buffer)
-            {
-                pr_err("_NR_ %s - Could not allocate int_out_buffer\n",
-                       __func__);
-                goto error;
-            }
         }
     }
     if (!dev->int_in_endpoint)
@@ -657,40 +2801,199 @@ static int nr_probe(struct usb_interface *interface,
         goto error;
     }
 
-    // intialization of the urb for the usb reading
-    // The first parameter (iso_packets) is the number of isochronous
-    //   packets this urb should contain. If you do not want to create
-    //   an isochronous urb, this variable should be set to 0 .
-    dev->int_in_urb = usb_alloc_urb(0, GFP_KERNEL);
+    // the receive ring, where the completion handler queues the frames until
+    //   read() (or the program that mapped it) takes them
+    dev->rx_ring = nr_alloc_ring(rx_fifo_frames, &dev->rx_ring_size,
+                                 &dev->rx_ring_bytes);
+    if (!dev->rx_ring)
+    {
+        pr_err("_NR_ %s - Could not allocate the receive ring\n", __func__);
+        goto error;
+    }
+    dev->rx_slots = (struct nr_ring_slot *)((char *)dev->rx_ring + PAGE_SIZE);
 
-    if (!dev->int_in_urb)
+    // who each frame of the ring was delivered to
+    dev->rx_deliver = kvcalloc(dev->rx_ring_size, sizeof(u64), GFP_KERNEL);
+    if (!dev->rx_deliver)
     {
-        pr_err("_NR_ %s - Could not allocate int_in_urb\n", __func__);
+        pr_err("_NR_ %s - Could not allocate the receive ring\n", __func__);
         goto error;
     }
 
-    // intialization of the urb for the usb writing
-    dev->int_out_urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!dev->int_out_urb)
+    // the transmit ring, filled by a program that mapped it
+    dev->tx_ring = nr_alloc_ring(tx_ring_frames, &dev->tx_ring_size,
+                                 &dev->tx_ring_bytes);
+    if (!dev->tx_ring)
     {
-        pr_err("_NR_ %s - Could not allocate int_out_urb\n", __func__);
+        pr_err("_NR_ %s - Could not allocate the transmit ring\n", __func__);
         goto error;
     }
+    dev->tx_slots = (struct nr_ring_slot *)((char *)dev->tx_ring + PAGE_SIZE);
+
+    // intialization of the urbs for the usb reading, each one with its own
+    //   buffer so that several of them can be in flight at the same time
+    dev->n_in_urbs = clamp_t(unsigned int, in_urbs, 1, NR_MAX_IN_URBS);
+    for (i = 0; i < dev->n_in_urbs; ++i)
+    {
+        unsigned char *buf;
+
+        // The first parameter (iso_packets) is the number of isochronous
+        //   packets this urb should contain. If you do not want to create
+        //   an isochronous urb, this variable should be set to 0 .
+        urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!urb)
+        {
+            pr_err("_NR_ %s - Could not allocate int_in_urb\n", __func__);
+            goto error;
+        }
+        // The buffer is allocated once for all in DMA-coherent memory: its bus
+        //   address is stored in urb->transfer_dma and the host controller
+        //   does not have to map and unmap it for each transfer (see
+        //   URB_NO_TRANSFER_DMA_MAP below).
+        buf = usb_alloc_coherent(dev->usbdev,
+                                 dev->int_in_endpoint->wMaxPacketSize,
+                                 GFP_KERNEL, &urb->transfer_dma);
+        if (!buf)
+        {
+            pr_err("_NR_ %s - Could not allocate int_in_urb buffer\n",
+                   __func__);
+            usb_free_urb(urb);
+            goto error;
+        }
+
+        // The function usb_fill_int_urb is a helper function to properly
+        //   initialize a urb to be sent to an interrupt endpoint of a USB
+        //   device:
+        usb_fill_int_urb(
+            // urb* : A pointer to the urb to be initialized.
+            urb,
+
+            // usb_device* : The USB device to which this urb is to be sent.
+            dev->usbdev,
+
+            // unsigned int : The specific endpoint of the USB device to which
+            //   this urb is to be sent. This value is created with the
+            //   previously mentioned usb_sndintpipe or usb_rcvintpipe
+            //   functions.
+            //       usb_rcvintpipe() specifies an interrupt IN endpoint for
+            //       the specified USB device with the specified endpoint
+            //       number.
+            usb_rcvintpipe(dev->usbdev,
+                           dev->int_in_endpoint->bEndpointAddress),
+
+            // A pointer to the buffer from which outgoing data is taken or
+            //   into which incoming data is received. Note that this can not
+            //   be a static buffer and must be created with a call to kmalloc
+            //   (or usb_alloc_coherent() as here).
+            buf,
+
+            // The length of the buffer pointed to by the transfer_buffer
+            //   pointer
+            dev->int_in_endpoint->wMaxPacketSize,
+
+            // usb_complete_t : Pointer to the completion handler that is
+            //   called when this urb is completed.
+            nr_read_int_callback,
+
+            // void * : Pointer to the blob that is added to the urb structure
+            //   for later retrieval by the completion handler function.
+            &dev->in_ctx[i],
+
+            // int : The interval at which that this urb should be scheduled.
+            dev->int_in_endpoint->bInterval);
+
+        // tells the USB core that urb->transfer_dma is already valid
+        urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+        dev->in_ctx[i].dev = dev;
+        dev->int_in_urbs[i] = urb;
+    }
+
+    // intialization of the pool of urbs for the usb writing, their buffer
+    //   receives the frame in write()
+    dev->n_out_urbs = clamp_t(unsigned int, out_urbs, 1, NR_MAX_OUT_URBS);
+    for (i = 0; i < dev->n_out_urbs; ++i)
+    {
+        unsigned char *buf;
+
+        urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!urb)
+        {
+            pr_err("_NR_ %s - Could not allocate int_out_urb\n", __func__);
+            goto error;
+        }
+        // DMA-coherent, as the buffers of the IN urbs
+        buf = usb_alloc_coherent(dev->usbdev,
+                                 dev->int_out_endpoint->wMaxPacketSize,
+                                 GFP_KERNEL, &urb->transfer_dma);
+        if (!buf)
+        {
+            pr_err("_NR_ %s - Could not allocate int_out_urb buffer\n",
+                   __func__);
+            usb_free_urb(urb);
+            goto error;
+        }
+
+        // same as for the IN urbs, usb_sndintpipe() specifies an interrupt OUT
+        //   endpoint. The length is set by write() for each frame.
+        usb_fill_int_urb(urb,
+                         dev->usbdev,
+                         usb_sndintpipe(dev->usbdev,
+                                        dev->int_out_endpoint->bEndpointAddress),
+                         buf,
+                         dev->int_out_endpoint->wMaxPacketSize,
+                         nr_write_int_callback,
+                         &dev->out_ctx[i],
+                         dev->int_out_endpoint->bInterval);
+        urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+        dev->out_ctx[i].dev = dev;
+        dev->int_out_urbs[i] = urb;
+        dev->tx_free[dev->tx_free_count++] = urb;
+    }
 
     // eveything went well,
     //   we save our data pointer in this interface device
     usb_set_intfdata(interface, dev);
 
-    // we register the driver
-    retval = usb_register_dev(interface, &nr_class);
+    // the adapter is either a network interface
+    if (socketcan)
+    {
+        retval = nr_can_register(interface, dev);
+        if (retval)
+        {
+            usb_set_intfdata(interface, NULL);
+            goto error;
+        }
+    }
+    // or a character device: we register the driver
+    else
+    {
+        retval = usb_register_dev(interface, &nr_class);
+        if (retval)
+        {
+            // something prevented us from registering this driver
+            pr_err("_NR_ %s - Not able to get a minor for this device.\n",
+                   __func__);
+            usb_set_intfdata(interface, NULL);
+            goto error;
+        }
+    }
+
+    // from now on the IN urbs stay in flight, the frames are collected by the
+    //   completion handler whether or not somebody is reading
+    retval = nr_start_in_urbs(dev);
     if (retval)
     {
-        // something prevented us from registering this driver
-        pr_err("_NR_ %s - Not able to get a minor for this device.\n",
-               __func__);
-        usb_set_intfdata(interface, NULL);
-        goto error;
+        // The device is already registered: an open() may hold a reference
+        //   to it. It goes away as if it had been unplugged, the memory is
+        //   freed by the last kref_put().
+        nr_disconnect(interface);
+        return retval;
     }
+
+    // the latency histograms, nothing to do if debugfs is not there
+    nr_debugfs_add(interface, dev);
     return 0; // return 0 indicates we will manage this device
 
 error: // we use goto in order to be sure to free
@@ -707,6 +3010,8 @@ error: // we use goto in order to be sure to free
 static void nr_disconnect(struct usb_interface *interface)
 {
     struct usb_nr *dev;
+    unsigned int i;
+    bool netdev = false;
 
     // prevent open() from racing disconnect(): not interruptible
     mutex_lock(&disconnect_mutex);
@@ -719,18 +3024,242 @@ static void nr_disconnect(struct usb_interface *interface)
     usb_set_intfdata(interface, NULL);
     if (dev)
     {
-        // we need to free the memory allocated to the struct usb_nr
-        free_usb_nr(dev);
+        // from now on read(), write()... fail with -ENODEV, and no urb can be
+        //   taken from the transmit pool (see nr_get_tx_urb())
+        spin_lock_irq(&dev->int_out_lock);
+        WRITE_ONCE(dev->disconnected, true);
+        spin_unlock_irq(&dev->int_out_lock);
+
+        // waits for the readers of the histograms
+        debugfs_remove_recursive(dev->debugfs);
+
+        // Kill the urbs in flight and make any later submission fail (-EPERM),
+        //   whether it comes from write(), from the doorbell or from a
+        //   completion handler: nothing can reach the device any more.
+        for (i = 0; i < dev->n_in_urbs; ++i)
+            usb_poison_urb(dev->int_in_urbs[i]);
+        for (i = 0; i < dev->n_out_urbs; ++i)
+            usb_poison_urb(dev->int_out_urbs[i]);
+
+        // a stalled endpoint may be being cleared: its resubmissions fail
+        //   now, but the work must be over before the urbs are freed
+        cancel_work_sync(&dev->in_halt_work);
+
+        // the network interface goes away, nothing can be sent or received
+        //   through it any more
+        if (dev->netdev)
+        {
+            netdev = true;
+            nr_can_unregister(dev);
+        }
+
+        // the processes sleeping in read() or write() (or poll()) have to
+        //   notice
+        spin_lock_irq(&dev->int_in_lock);
+        for (i = 0; i < NR_MAX_READERS; ++i)
+            if (dev->readers[i])
+                wake_up_interruptible_all(&dev->readers[i]->rx_wait);
+        spin_unlock_irq(&dev->int_in_lock);
+        wake_up_all(&dev->int_out_wait);
+
+        // A write() may still hold an urb taken from the pool, filling its
+        //   buffer: its submission fails now, and it gives the urb back. Once
+        //   they are all back, empty the pool so that nobody takes one again
+        //   and free them while the host controller is still there. Only the
+        //   rings and the structure itself wait for the last open file.
+        wait_event(dev->int_out_wait, nr_close_tx_pool(dev));
+        nr_free_urbs(dev);
+
+        // drop the reference of the interface, the memory is freed now or
+        //   when the last open file is closed
+        kref_put(&dev->kref, nr_delete);
     }
 
     // give back the minor
     //   (to avoid the incrementation of the file-node- in /dev/)
-    usb_deregister_dev(interface, &nr_class);
+    if (!netdev)
+        usb_deregister_dev(interface, &nr_class);
 
     // release the lock
     mutex_unlock(&disconnect_mutex);
 }
 
+//------------------------------------------------------------
+//                         STATISTICS
+//------------------------------------------------------------
+// The counters of the device are read-only files of the "statistics"
+//   directory of the interface in sysfs, for instance
+//   /sys/bus/usb/devices/1-1:1.0/statistics/rx_frames. The USB core creates
+//   them once probe() succeeded and removes them before calling disconnect(),
+//   so the device is always there when they are read.
+
+// the device of an interface, from the struct device of the interface
+static struct usb_nr *nr_from_device(struct device *d)
+{
+    return usb_get_intfdata(to_usb_interface(d));
+}
+
+// one file per counter of struct nr_stats
+#define NR_STAT_ATTR(name)                                                   \
+    static ssize_t name##_show(struct device *d,                             \
+                               struct device_attribute *attr, char *buf)     \
+    {                                                                        \
+        return sysfs_emit(buf, "%ld\n",                                      \
+                          atomic_long_read(&nr_from_device(d)->stats.name)); \
+    }                                                                        \
+    static DEVICE_ATTR_RO(name)
+
+NR_STAT_ATTR(rx_urbs_submitted);
+NR_STAT_ATTR(rx_urbs_completed);
+NR_STAT_ATTR(tx_urbs_submitted);
+NR_STAT_ATTR(tx_urbs_completed);
+NR_STAT_ATTR(rx_frames);
+NR_STAT_ATTR(rx_bytes);
+NR_STAT_ATTR(tx_frames);
+NR_STAT_ATTR(tx_bytes);
+NR_STAT_ATTR(rx_errors);
+NR_STAT_ATTR(tx_errors);
+NR_STAT_ATTR(rx_overruns);
+
+// one line per completion status seen: the status (0 for success) and the
+//   number of urbs
+static ssize_t nr_status_show(atomic_long_t *table, char *buf)
+{
+    ssize_t len = 0;
+    long n;
+    int i;
+
+    for (i = 0; i < NR_STATUS_CODES; ++i)
+    {
+        n = atomic_long_read(&table[i]);
+        if (n == 0)
+            continue;
+        if (i == NR_STATUS_CODES - 1)
+            len += sysfs_emit_at(buf, len, "other %ld\n", n);
+        else
+            len += sysfs_emit_at(buf, len, "%d %ld\n", -i, n);
+    }
+    return len;
+}
+
+static ssize_t rx_status_show(struct device *d, struct device_attribute *attr,
+                              char *buf)
+{
+    return nr_status_show(nr_from_device(d)->stats.rx_status, buf);
+}
+static DEVICE_ATTR_RO(rx_status);
+
+static ssize_t tx_status_show(struct device *d, struct device_attribute *attr,
+                              char *buf)
+{
+    return nr_status_show(nr_from_device(d)->stats.tx_status, buf);
+}
+static DEVICE_ATTR_RO(tx_status);
+
+// frames of the transmit ring that could not be sent
+static ssize_t tx_overruns_show(struct device *d,
+                                struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%lu\n",
+                      READ_ONCE(nr_from_device(d)->tx_ring_overruns));
+}
+static DEVICE_ATTR_RO(tx_overruns);
+
+// frames waiting for the reader that is the most behind
+static ssize_t rx_queue_show(struct device *d, struct device_attribute *attr,
+                             char *buf)
+{
+    struct usb_nr *dev = nr_from_device(d);
+    unsigned int depth = 0;
+    int i;
+
+    spin_lock_irq(&dev->int_in_lock);
+    for (i = 0; i < NR_MAX_READERS; ++i)
+        if (dev->readers[i])
+            depth = max(depth, dev->readers[i]->rx_pending);
+    spin_unlock_irq(&dev->int_in_lock);
+    return sysfs_emit(buf, "%u\n", min(depth, dev->rx_ring_size));
+}
+static DEVICE_ATTR_RO(rx_queue);
+
+// number of files open for reading
+static ssize_t readers_show(struct device *d, struct device_attribute *attr,
+                            char *buf)
+{
+    struct usb_nr *dev = nr_from_device(d);
+    unsigned int n = 0;
+    int i;
+
+    spin_lock_irq(&dev->int_in_lock);
+    for (i = 0; i < NR_MAX_READERS; ++i)
+        if (dev->readers[i])
+            n++;
+    spin_unlock_irq(&dev->int_in_lock);
+    return sysfs_emit(buf, "%u\n", n);
+}
+static DEVICE_ATTR_RO(readers);
+
+// OUT urbs in flight
+static ssize_t tx_queue_show(struct device *d, struct device_attribute *attr,
+                             char *buf)
+{
+    struct usb_nr *dev = nr_from_device(d);
+    unsigned int in_flight;
+
+    spin_lock_irq(&dev->int_out_lock);
+    in_flight = dev->n_out_urbs - dev->tx_free_count;
+    spin_unlock_irq(&dev->int_out_lock);
+    return sysfs_emit(buf, "%u\n", in_flight);
+}
+static DEVICE_ATTR_RO(tx_queue);
+
+// frames of the transmit ring not sent yet
+static ssize_t tx_ring_queue_show(struct device *d,
+                                  struct device_attribute *attr, char *buf)
+{
+    struct usb_nr *dev = nr_from_device(d);
+    unsigned int ring;
+
+    spin_lock_irq(&dev->int_out_lock);
+    ring = min(READ_ONCE(dev->tx_ring->head) - dev->tx_tail,
+               dev->tx_ring_size);
+    spin_unlock_irq(&dev->int_out_lock);
+    return sysfs_emit(buf, "%u\n", ring);
+}
+static DEVICE_ATTR_RO(tx_ring_queue);
+
+static struct attribute *nr_stats_attrs[] = {
+    &dev_attr_rx_urbs_submitted.attr,
+    &dev_attr_rx_urbs_completed.attr,
+    &dev_attr_tx_urbs_submitted.attr,
+    &dev_attr_tx_urbs_completed.attr,
+    &dev_attr_rx_frames.attr,
+    &dev_attr_rx_bytes.attr,
+    &dev_attr_tx_frames.attr,
+    &dev_attr_tx_bytes.attr,
+    &dev_attr_rx_errors.attr,
+    &dev_attr_tx_errors.attr,
+    &dev_attr_rx_overruns.attr,
+    &dev_attr_tx_overruns.attr,
+    &dev_attr_rx_status.attr,
+    &dev_attr_tx_status.attr,
+    &dev_attr_rx_queue.attr,
+    &dev_attr_tx_queue.attr,
+    &dev_attr_tx_ring_queue.attr,
+    &dev_attr_readers.attr,
+    NULL,
+};
+
+static const struct attribute_group nr_stats_group = {
+    .name = "statistics",
+    .attrs = nr_stats_attrs,
+};
+
+static const struct attribute_group *nr_groups[] = {
+    &nr_stats_group,
+    NULL,
+};
+
 // The main structure that all USB drivers must create is a struct usb_driver to
 //   create a value struct usb_driver structure, only four fields need to
 //   beinitialized
@@ -751,6 +3280,10 @@ static struct usb_driver nr_driver = {
 
     // Pointer to the disconnect function in the USB driver.
     .disconnect = nr_disconnect,
+
+    // The attributes created in sysfs for each interface the driver manages
+    //  (see the STATISTICS section)
+    .dev_groups = nr_groups,
 };
 
 //------------------------------------------------------------
@@ -764,10 +3297,17 @@ static struct usb_driver nr_driver = {
 static int __init usb_nr_init(void)
 {
     int retval = -1;
+
+    // before the first probe(), which adds the directories of the devices
+    nr_debugfs_root = debugfs_create_dir("nr_driver", NULL);
+
     retval = usb_register(&nr_driver);
     if (retval)
+    {
         pr_err("_NR_ %s - usb_register failed. Error number %d\n", __func__,
                retval);
+        debugfs_remove_recursive(nr_debugfs_root);
+    }
     return retval;
 }
 
@@ -781,6 +3321,7 @@ static int __init usb_nr_init(void)
 static void __exit usb_nr_exit(void)
 {
     usb_deregister(&nr_driver);
+    debugfs_remove_recursive(nr_debugfs_root);
 }
 
 // link the init and exit function to the module
@@ -789,3 +3330,8 @@ module_exit(usb_nr_exit);
 
 MODULE_AUTHOR("Ayush Abrol\n");
 MODULE_LICENSE("GPL");
+
+// the KUnit tests need the static functions of this file
+#if IS_ENABLED(CONFIG_NR_DRIVER_KUNIT_TEST)
+#include "nr_driver_test.c"
+#endif
@@ -0,0 +1,379 @@
+/*
+ * Definitions shared between the nr_driver kernel module and the programs
+ * using /dev/nr_driverX. This file is included by nr_driver.c and can be
+ * included as is by a user space program.
+ * ------------------------------------------------------------
+ *                  MEMORY MAPPED RECEIVE RING
+ * ------------------------------------------------------------
+ * The frames received from the device are stored by the driver in a ring
+ * that a program can map in its address space:
+ *
+ *      fd = open("/dev/nr_driver0", O_RDONLY);
+ *      hdr = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd,
+ *                 NR_MMAP_RX_OFFSET);
+ *      size = hdr->map_size;
+ *      munmap(hdr, getpagesize());
+ *      hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, NR_MMAP_RX_OFFSET);
+ *      slots = (struct nr_ring_slot *)((char *)hdr + hdr->data_offset);
+ *
+ * The ring is shared by every reader of the device: the driver writes the
+ * frames at "head" and never waits for anybody, once the ring is full each new
+ * frame overwrites the oldest one. Each reader keeps its own cursor ("tail"
+ * below, a free running counter as "head"; the slot of an index is
+ * index & (size - 1)) and checks the index of each slot, which tells whether
+ * the frame was overwritten before or while it was being copied:
+ *
+ *      head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+ *      if (head - tail > hdr->size)
+ *          tail = head - hdr->size;            // lapped, frames were lost
+ *      while (tail != head) {
+ *          slot = &slots[tail & (hdr->size - 1)];
+ *          if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail)
+ *              break;                          // lapped, start over
+ *          memcpy(frame, slot->data, slot->len);
+ *          __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *          if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != tail)
+ *              break;                          // overwritten while copied
+ *          ... use frame ...
+ *          tail++;
+ *      }
+ *
+ * No system call is needed while frames keep coming. The ring can only be
+ * mapped read only (PROT_WRITE gets EPERM), since read() and the other
+ * readers take their frames from the same pages: the cursor of the program is
+ * kept in its own memory. poll() reports
+ * POLLIN according to the cursor read() uses, not the one of the mapping.
+ *
+ * read() gives back the same frames: every open file descriptor has its own
+ * cursor and gets every frame received after it was opened. The frames a
+ * reader misses because it did not keep up are counted, see
+ * NR_IOC_GET_RX_STATS.
+ * ------------------------------------------------------------
+ *                        READER GROUPS
+ * ------------------------------------------------------------
+ * Instead of getting every frame, several file descriptors can share the
+ * stream: once they joined the same group with NR_IOC_SET_GROUP (right after
+ * open()), each received frame is given to exactly one member of the group
+ * by read(). The member is chosen round robin (NR_GROUP_ROUND_ROBIN) or from
+ * the CAN identifier of the frame (NR_GROUP_HASH_ID), in which case all the
+ * frames with the same identifier go to the same member, in order, as long as
+ * the members of the group do not change. Joining group 0 goes back to
+ * getting every frame. The memory mapped ring is not concerned by the groups.
+ * ------------------------------------------------------------
+ *                    ACCEPTANCE FILTERS
+ * ------------------------------------------------------------
+ * A reader only interested in some CAN identifiers installs filters with
+ * NR_IOC_SET_FILTER: a frame is then given to it by read() if its identifier
+ * (see nr_frame_can_id()) matches one of the id/mask pairs, as with the
+ * CAN_RAW_FILTER option of SocketCAN, or is one of the identifiers of the
+ * exact match list, meant for long lists of identifiers:
+ *
+ *      struct nr_can_filter masks[] = {
+ *          { 0x100, 0x7f0 },                   // 0x100 to 0x10f
+ *      };
+ *      __u32 ids[] = { 0x7df, 0x7e8, NR_CAN_EFF_FLAG | 0x18db33f1 };
+ *      struct nr_filter_req req = {
+ *          .n_masks = 1, .n_ids = 3,
+ *          .masks = (__u64)(uintptr_t)masks, .ids = (__u64)(uintptr_t)ids,
+ *      };
+ *      ioctl(fd, NR_IOC_SET_FILTER, &req);
+ *
+ * The filters are checked when the frame is received, a frame that does not
+ * pass them is neither copied nor signaled to the reader. In a group, a frame
+ * goes to one of the members whose filters accept it. Installing an empty
+ * filter (no mask, no identifier) gives every frame again.
+ *
+ * When the identifier is not enough, a reader can also attach a classic BPF
+ * program with NR_IOC_SET_BPF, as SO_ATTACH_FILTER does on a socket. The
+ * program runs on the 64 bytes of each received frame (the identifier must
+ * have passed the filters above, if any) and returns 0 to drop the frame or
+ * the number of bytes of the frame read() gives back. Unlike on a socket the
+ * only loads from the frame are aligned 32 bits words, in the byte order of
+ * the host ("ld [k]" with k a multiple of 4, "len" is 64):
+ *
+ *      struct sock_filter code[] = {
+ *          BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4),      // bytes 4 to 7
+ *          BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xff00),// byte 5 (x86)
+ *          BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, 0, 1),
+ *          BPF_STMT(BPF_RET | BPF_K, 16),              // keep 16 bytes
+ *          BPF_STMT(BPF_RET | BPF_K, 0),               // drop
+ *      };
+ *      struct nr_bpf_req req = {
+ *          .len = 5, .filter = (__u64)(uintptr_t)code,
+ *      };
+ *      ioctl(fd, NR_IOC_SET_BPF, &req);
+ * ------------------------------------------------------------
+ *                     RECEIVE TIMESTAMPS
+ * ------------------------------------------------------------
+ * The driver takes the time (CLOCK_MONOTONIC) when each frame arrives, before
+ * any process is scheduled, and stores it in the "tstamp" field of the slot.
+ * read() only gives back the frames unless NR_IOC_SET_RX_TSTAMP selects a
+ * clock for the file descriptor: each frame is then preceded by a
+ * struct nr_rx_header holding the timestamp on that clock and the length of
+ * the frame, and a read() returns as many records as fit in the buffer (which
+ * must hold at least one header and NR_FRAME_SIZE bytes):
+ *
+ *      __u32 clock = NR_TSTAMP_MONOTONIC;
+ *      ioctl(fd, NR_IOC_SET_RX_TSTAMP, &clock);
+ *      n = read(fd, buf, sizeof(buf));
+ *      for (p = buf; p < buf + n; p += sizeof(*hdr) + hdr->len) {
+ *          hdr = (struct nr_rx_header *)p;
+ *          ... hdr->tstamp, frame at p + sizeof(*hdr) ...
+ *      }
+ *
+ * Each record starts on a 8 bytes boundary when the frames are 64 bytes long,
+ * which is always the case with this adapter. The CLOCK_BOOTTIME and
+ * CLOCK_REALTIME timestamps are converted from the monotonic one when the
+ * frame is read.
+ * ------------------------------------------------------------
+ *                  MEMORY MAPPED TRANSMIT RING
+ * ------------------------------------------------------------
+ * The transmit ring has the same layout, mapped at NR_MMAP_TX_OFFSET, but the
+ * roles are swapped: the program writes the frames at "head" and the driver
+ * sends them and moves "tail". After having queued some frames the program
+ * rings the doorbell once:
+ *
+ *      while (head - __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE) <
+ *             hdr->size && ... more frames ...) {
+ *          slot = &slots[head & (hdr->size - 1)];
+ *          memcpy(slot->data, frame, len);
+ *          slot->len = len;
+ *          head++;
+ *      }
+ *      __atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+ *      ioctl(fd, NR_IOC_TX_KICK);
+ *
+ * From there the driver keeps on sending the frames of the ring each time an
+ * OUT urb completes, so frames queued while earlier ones are still on the
+ * wire go out without any system call. As the program can not know when the
+ * driver stops, it rings the doorbell after each batch; a doorbell with
+ * nothing left to send costs a system call and nothing else. "overruns"
+ * counts the frames that could not be sent.
+ * ------------------------------------------------------------
+ */
+
+#ifndef NR_DRIVER_H
+#define NR_DRIVER_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// size of the reports exchanged with the adapter (wMaxPacketSize of both
+//   interrupt endpoints)
+#define NR_FRAME_SIZE 64
+
+// offset to give to mmap() to map the receive ring
+#define NR_MMAP_RX_OFFSET 0x00000000UL
+
+// offset to give to mmap() to map the transmit ring
+#define NR_MMAP_TX_OFFSET 0x10000000UL
+
+// ioctl commands of /dev/nr_driverX
+#define NR_IOC_MAGIC 'n'
+
+// doorbell of the transmit ring: sends the frames between tail and head
+#define NR_IOC_TX_KICK _IO(NR_IOC_MAGIC, 0x01)
+
+// counters of the reader (the open file descriptor), struct nr_rx_stats
+#define NR_IOC_GET_RX_STATS _IOR(NR_IOC_MAGIC, 0x02, struct nr_rx_stats)
+
+// join (or leave, group 0) a group of readers, struct nr_group_req
+#define NR_IOC_SET_GROUP _IOW(NR_IOC_MAGIC, 0x03, struct nr_group_req)
+
+// install the acceptance filters of the reader, struct nr_filter_req
+#define NR_IOC_SET_FILTER _IOW(NR_IOC_MAGIC, 0x04, struct nr_filter_req)
+
+// attach (or remove, len 0) a classic BPF filter program, struct nr_bpf_req
+#define NR_IOC_SET_BPF _IOW(NR_IOC_MAGIC, 0x05, struct nr_bpf_req)
+
+// choose the header read() puts before each frame, __u32 (NR_TSTAMP_*)
+#define NR_IOC_SET_RX_TSTAMP _IOW(NR_IOC_MAGIC, 0x06, __u32)
+
+// clocks of the receive timestamps, NR_TSTAMP_NONE for no header
+#define NR_TSTAMP_NONE 0
+#define NR_TSTAMP_MONOTONIC 1
+#define NR_TSTAMP_BOOTTIME 2
+#define NR_TSTAMP_REALTIME 3
+
+// maximal number of id/mask pairs and of identifiers in the exact match list
+//   of one reader
+#define NR_MAX_MASK_FILTERS 32
+#define NR_MAX_ID_FILTERS 4096
+
+// how a group of readers shares the frames (struct nr_group_req.mode)
+#define NR_GROUP_ROUND_ROBIN 0
+#define NR_GROUP_HASH_ID 1
+
+// The reports of the adapter carry a CAN frame laid out as the MCP2515 CAN
+//   controller registers (as in the frame built by nrtest_write.py): a
+//   command in byte 0, the identifier in bytes 1 to 4 (SIDH, SIDL, EID8,
+//   EID0), the DLC in byte 5 and the data from byte 6.
+#define NR_FRAME_CMD 0
+#define NR_FRAME_SIDH 1
+#define NR_FRAME_SIDL 2
+#define NR_FRAME_EID8 3
+#define NR_FRAME_EID0 4
+#define NR_FRAME_DLC 5
+#define NR_FRAME_DATA 6
+
+// SIDL bit telling the identifier is an extended (29 bits) one
+#define NR_SIDL_EXIDE 0x08
+
+// DLC bit of a remote frame, and the bits of the length
+#define NR_DLC_RTR 0x40
+#define NR_DLC_LEN 0x0f
+
+// first byte of the reports sending a CAN frame (as in nrtest_write.py)
+#define NR_CMD_TX 0x83
+
+// flag set by nr_frame_can_id() on extended identifiers, same value as
+//   CAN_EFF_FLAG in <linux/can.h>
+#define NR_CAN_EFF_FLAG 0x80000000U
+
+// identifier of the CAN frame carried by a report: 11 bits, or 29 bits with
+//   NR_CAN_EFF_FLAG set
+static inline __u32 nr_frame_can_id(const __u8 *data)
+{
+    __u32 sid = ((__u32)data[NR_FRAME_SIDH] << 3) |
+                (data[NR_FRAME_SIDL] >> 5);
+
+    if (!(data[NR_FRAME_SIDL] & NR_SIDL_EXIDE))
+        return sid;
+    return NR_CAN_EFF_FLAG | (sid << 18) |
+           ((__u32)(data[NR_FRAME_SIDL] & 0x03) << 16) |
+           ((__u32)data[NR_FRAME_EID8] << 8) | data[NR_FRAME_EID0];
+}
+
+// first page of the receive and transmit rings
+struct nr_ring_header
+{
+    // number of frames written (free running), by the driver in the
+    //   receive ring and by the program in the transmit ring
+    __u32 head;
+
+    // number of frames consumed (free running) by the driver in the transmit
+    //   ring, unused in the receive ring
+    __u32 tail;
+
+    // number of slots, a power of two
+    __u32 size;
+
+    // size of a slot, sizeof(struct nr_ring_slot)
+    __u32 slot_size;
+
+    // offset of the first slot from the start of the mapping
+    __u32 data_offset;
+
+    // length to give to mmap() to map the whole ring
+    __u32 map_size;
+
+    // transmit ring: number of frames that could not be sent
+    // receive ring: unused, always 0 (each reader counts the frames it
+    //   missed, see struct nr_rx_stats)
+    __u32 overruns;
+};
+
+// one frame
+struct nr_ring_slot
+{
+    // index of the frame (the value of head when it was written), only set
+    //   in the receive ring
+    __u32 seq;
+
+    // number of bytes in data
+    __u16 len;
+
+    // unused for now, always 0
+    __u16 flags;
+
+    // time the frame was received, in nanoseconds on CLOCK_MONOTONIC, only
+    //   set in the receive ring
+    __u64 tstamp;
+
+    // the report as sent by (or to) the device
+    __u8 data[NR_FRAME_SIZE];
+};
+
+// header of each frame given back by read() once NR_IOC_SET_RX_TSTAMP chose
+//   a clock
+struct nr_rx_header
+{
+    // time the frame was received, in nanoseconds on the chosen clock
+    __u64 tstamp;
+
+    // index of the frame in the receive ring: a gap tells frames were
+    //   dropped (filters, groups) or lost (overruns)
+    __u32 seq;
+
+    // number of bytes of the frame following the header
+    __u16 len;
+
+    // unused for now, always 0
+    __u16 flags;
+};
+
+// argument of NR_IOC_SET_GROUP
+struct nr_group_req
+{
+    // identifier of the group (chosen by the programs), 0 to leave it
+    __u32 group;
+
+    // NR_GROUP_ROUND_ROBIN or NR_GROUP_HASH_ID, the same for all the members
+    __u32 mode;
+};
+
+// one id/mask pair: a frame matches when (frame id & mask) == (id & mask)
+struct nr_can_filter
+{
+    __u32 id;
+    __u32 mask;
+};
+
+// argument of NR_IOC_SET_FILTER
+struct nr_filter_req
+{
+    // number of id/mask pairs, at most NR_MAX_MASK_FILTERS
+    __u32 n_masks;
+
+    // number of identifiers in the exact match list, at most
+    //   NR_MAX_ID_FILTERS
+    __u32 n_ids;
+
+    // address of the array of the n_masks id/mask pairs
+    //   (struct nr_can_filter)
+    __u64 masks;
+
+    // address of the array of the n_ids identifiers (__u32, with
+    //   NR_CAN_EFF_FLAG for the extended ones)
+    __u64 ids;
+};
+
+// argument of NR_IOC_SET_BPF
+struct nr_bpf_req
+{
+    // number of instructions, 0 to remove the program
+    __u32 len;
+
+    __u32 reserved;
+
+    // address of the instructions (struct sock_filter of <linux/filter.h>)
+    __u64 filter;
+};
+
+// counters of one reader, returned by NR_IOC_GET_RX_STATS
+struct nr_rx_stats
+{
+    // number of frames read by this file descriptor
+    __u64 frames;
+
+    // number of frames for this file descriptor overwritten before it read
+    //   them
+    __u64 overruns;
+
+    // number of frames waiting to be read
+    __u32 pending;
+
+    __u32 reserved;
+};
+
+#endif // NR_DRIVER_H
@@ -0,0 +1,1098 @@
+/*
+ * KUnit tests of nr_driver: the I/O core (completion handlers, receive ring,
+ * read(), write(), flush()) run against a fake USB core, and the helpers of
+ * the filters and of the groups. The file is included at the end of
+ * nr_driver.c when the module is built with
+ *
+ *      make CONFIG_NR_DRIVER_KUNIT_TEST=y
+ *
+ * (the kernel needs CONFIG_KUNIT) and the tests run when the module is
+ * loaded, their results are in the kernel log and in
+ * /sys/kernel/debug/kunit/nr_driver/results. No adapter is needed: the urbs
+ * of the tests never reach a device, nr_usb_submit_urb() only anchors them
+ * and each test completes them itself, in the order and with the status it
+ * wants. The module built this way is not meant to drive a real adapter.
+ *
+ * The "bench" cases measure the hot path (a frame received and read, a
+ * lookup in the filters) and print the time per operation, they always pass.
+ */
+
+#include <kunit/test.h>
+#include <linux/completion.h> // wait_for_completion()
+#include <linux/delay.h> // msleep()
+#include <linux/kthread.h> // kthread_run()
+
+//------------------------------------------------------------
+//                      FAKE USB CORE
+//------------------------------------------------------------
+// number of urbs submitted, and error given to the submissions once
+//   nr_test_submit_limit urbs have been submitted (0 to accept them all)
+static unsigned int nr_test_submitted;
+static unsigned int nr_test_submit_limit;
+static int nr_test_submit_error;
+
+// halts cleared by the work of the stalled endpoint
+static atomic_t nr_test_halts;
+
+// replaces usb_submit_urb(): the urb is in flight as long as it is anchored
+static int nr_test_submit_urb(struct urb *urb, gfp_t mem_flags)
+{
+    // poisoned by usb_poison_urb(), as usb_hcd_submit_urb() does
+    if (atomic_read(&urb->reject))
+        return -EPERM;
+    if (nr_test_submit_error && nr_test_submitted >= nr_test_submit_limit)
+        return nr_test_submit_error;
+    nr_test_submitted++;
+    return 0;
+}
+
+// replaces nr_in_halt_work(), there is no endpoint to clear
+static void nr_test_halt_work(struct work_struct *work)
+{
+    atomic_inc(&nr_test_halts);
+}
+
+// true when the urb has been submitted and has not completed
+static bool nr_test_in_flight(struct urb *urb)
+{
+    return urb->anchor != NULL;
+}
+
+// Complete an urb as the USB core does: take it off its anchor, set the
+//   status and the data received (IN urbs) and call the handler.
+static void nr_test_complete(struct urb *urb, int status,
+                             const unsigned char *data, unsigned int len)
+{
+    usb_unanchor_urb(urb);
+    urb->status = status;
+    urb->actual_length = status ? 0 : len;
+    if (data)
+        memcpy(urb->transfer_buffer, data, len);
+    urb->complete(urb);
+}
+
+//------------------------------------------------------------
+//                      FAKE DEVICE
+//------------------------------------------------------------
+#define NR_TEST_RX_FRAMES 8
+#define NR_TEST_IN_URBS 3
+#define NR_TEST_OUT_URBS 2
+#define NR_TEST_FILES 4
+#define NR_TEST_URBS (NR_TEST_IN_URBS + NR_TEST_OUT_URBS)
+
+struct nr_test
+{
+    struct usb_nr *dev;
+    struct usb_endpoint_descriptor ep_in;
+    struct usb_endpoint_descriptor ep_out;
+    struct usb_device usbdev;
+
+    // no minor and no bus: usb_deregister_dev() and usb_free_coherent() do
+    //   nothing, the buffers of the urbs are freed by nr_test_exit()
+    struct usb_interface intf;
+    unsigned char *bufs[NR_TEST_URBS];
+    unsigned int n_bufs;
+
+    // completed by the thread running nr_disconnect()
+    struct completion disconnected;
+
+    // the open files, as the VFS would give them to the file operations
+    struct file filps[NR_TEST_FILES];
+    unsigned int n_files;
+};
+
+static struct urb *nr_test_urb(struct nr_test *t, usb_complete_t complete,
+                               struct nr_urb *ctx)
+{
+    struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
+    unsigned char *buf = kzalloc(NR_FRAME_SIZE, GFP_KERNEL);
+
+    if (!urb || !buf)
+    {
+        usb_free_urb(urb);
+        kfree(buf);
+        return NULL;
+    }
+    t->bufs[t->n_bufs++] = buf;
+
+    // no pipe: the urb only goes through nr_test_submit_urb()
+    usb_fill_int_urb(urb, &t->usbdev, 0, buf, NR_FRAME_SIZE, complete, ctx,
+                     1);
+    ctx->dev = t->dev;
+    return urb;
+}
+
+// the device as probe() leaves it, with its IN urbs in flight
+static int nr_test_init(struct kunit *test)
+{
+    struct nr_test *t;
+    struct usb_nr *dev;
+    unsigned int i;
+
+    t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+    if (!t)
+        return -ENOMEM;
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev)
+        return -ENOMEM;
+    t->dev = dev;
+    test->priv = t;
+
+    nr_test_submitted = 0;
+    nr_test_submit_limit = 0;
+    nr_test_submit_error = 0;
+    atomic_set(&nr_test_halts, 0);
+    nr_usb_submit_urb = nr_test_submit_urb;
+
+    kref_init(&dev->kref);
+    init_waitqueue_head(&dev->int_out_wait);
+    spin_lock_init(&dev->int_in_lock);
+    spin_lock_init(&dev->int_out_lock);
+    init_usb_anchor(&dev->int_in_anchor);
+    init_usb_anchor(&dev->int_out_anchor);
+    INIT_WORK(&dev->in_halt_work, nr_test_halt_work);
+
+    // the errors are logged against the usb device
+    t->usbdev.dev.init_name = "nr_test";
+    dev->usbdev = &t->usbdev;
+    t->ep_in.bEndpointAddress = USB_DIR_IN | 1;
+    t->ep_in.wMaxPacketSize = NR_FRAME_SIZE;
+    t->ep_out.bEndpointAddress = USB_DIR_OUT | 2;
+    t->ep_out.wMaxPacketSize = NR_FRAME_SIZE;
+    dev->int_in_endpoint = &t->ep_in;
+    dev->int_out_endpoint = &t->ep_out;
+    t->intf.minor = -1;
+    usb_set_intfdata(&t->intf, dev);
+    init_completion(&t->disconnected);
+
+    dev->rx_ring = nr_alloc_ring(NR_TEST_RX_FRAMES, &dev->rx_ring_size,
+                                 &dev->rx_ring_bytes);
+    dev->tx_ring = nr_alloc_ring(NR_MIN_RING, &dev->tx_ring_size,
+                                 &dev->tx_ring_bytes);
+    dev->rx_deliver = kvcalloc(dev->rx_ring_size, sizeof(u64), GFP_KERNEL);
+    if (!dev->rx_ring || !dev->tx_ring || !dev->rx_deliver)
+        return -ENOMEM;
+    dev->rx_slots = (struct nr_ring_slot *)((char *)dev->rx_ring + PAGE_SIZE);
+    dev->tx_slots = (struct nr_ring_slot *)((char *)dev->tx_ring + PAGE_SIZE);
+
+    for (i = 0; i < NR_TEST_IN_URBS; ++i)
+    {
+        dev->int_in_urbs[i] = nr_test_urb(t, nr_read_int_callback,
+                                          &dev->in_ctx[i]);
+        if (!dev->int_in_urbs[i])
+            return -ENOMEM;
+        dev->n_in_urbs++;
+    }
+    for (i = 0; i < NR_TEST_OUT_URBS; ++i)
+    {
+        dev->int_out_urbs[i] = nr_test_urb(t, nr_write_int_callback,
+                                           &dev->out_ctx[i]);
+        if (!dev->int_out_urbs[i])
+            return -ENOMEM;
+        dev->n_out_urbs++;
+        dev->tx_free[dev->tx_free_count++] = dev->int_out_urbs[i];
+    }
+    return nr_start_in_urbs(dev);
+}
+
+static void nr_test_exit(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev;
+    struct nr_file *file;
+    unsigned int i;
+
+    nr_usb_submit_urb = usb_submit_urb;
+    if (!t)
+        return;
+    dev = t->dev;
+
+    // release() and free_usb_nr() would give the fake usb_device back to the
+    //   USB core, everything is freed here instead (the urbs are already
+    //   freed if nr_disconnect() ran)
+    for (i = 0; i < t->n_files; ++i)
+    {
+        file = t->filps[i].private_data;
+        kvfree(file->filter);
+        kfree(file);
+    }
+    cancel_work_sync(&dev->in_halt_work);
+    for (i = 0; i < dev->n_in_urbs; ++i)
+    {
+        usb_unanchor_urb(dev->int_in_urbs[i]);
+        usb_free_urb(dev->int_in_urbs[i]);
+    }
+    for (i = 0; i < dev->n_out_urbs; ++i)
+    {
+        usb_unanchor_urb(dev->int_out_urbs[i]);
+        usb_free_urb(dev->int_out_urbs[i]);
+    }
+    for (i = 0; i < t->n_bufs; ++i)
+        kfree(t->bufs[i]);
+    vfree(dev->rx_ring);
+    vfree(dev->tx_ring);
+    kvfree(dev->rx_deliver);
+    kfree(dev);
+}
+
+// Open the device as nr_open() does, mode FMODE_READ and/or FMODE_WRITE.
+static struct file *nr_test_open(struct kunit *test, fmode_t mode)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct file *filp = &t->filps[t->n_files];
+    struct nr_file *file;
+    int i;
+
+    KUNIT_ASSERT_LT(test, t->n_files, NR_TEST_FILES);
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, file);
+    // the reference nr_open() takes, dropped by nr_release()
+    kref_get(&dev->kref);
+    file->dev = dev;
+    file->rx_id = -1;
+    init_waitqueue_head(&file->rx_wait);
+    if (mode & FMODE_READ)
+    {
+        spin_lock_irq(&dev->int_in_lock);
+        for (i = 0; i < NR_MAX_READERS && file->rx_id < 0; ++i)
+        {
+            if (!dev->readers[i])
+            {
+                file->rx_id = i;
+                dev->readers[i] = file;
+                dev->rx_broadcast |= BIT_ULL(i);
+                file->rx_seq = dev->rx_head;
+            }
+        }
+        spin_unlock_irq(&dev->int_in_lock);
+    }
+    filp->f_mode = mode;
+    filp->private_data = file;
+    t->n_files++;
+    return filp;
+}
+
+static ssize_t nr_test_read(struct file *filp, void *buf, size_t len)
+{
+    struct kvec kv = {.iov_base = buf, .iov_len = len};
+    struct iov_iter iter;
+    // a synchronous call, the file has no inode for init_sync_kiocb()
+    struct kiocb iocb = {.ki_filp = filp};
+
+    iov_iter_kvec(&iter, ITER_DEST, &kv, 1, len);
+    return nr_read_iter(&iocb, &iter);
+}
+
+static ssize_t nr_test_write(struct file *filp, const void *buf, size_t len)
+{
+    struct kvec kv = {.iov_base = (void *)buf, .iov_len = len};
+    struct iov_iter iter;
+    // a synchronous call, the file has no inode for init_sync_kiocb()
+    struct kiocb iocb = {.ki_filp = filp};
+
+    iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+    return nr_write_iter(&iocb, &iter);
+}
+
+// a report received from the adapter with a standard identifier and one
+//   data byte
+static void nr_test_frame(unsigned char *data, u32 id, u8 tag)
+{
+    memset(data, 0, NR_FRAME_SIZE);
+    data[NR_FRAME_SIDH] = id >> 3;
+    data[NR_FRAME_SIDL] = (id & 0x07) << 5;
+    data[NR_FRAME_DLC] = 1;
+    data[NR_FRAME_DATA] = tag;
+}
+
+// the IN urb i receives a frame
+static void nr_test_receive(struct usb_nr *dev, unsigned int i, u32 id, u8 tag)
+{
+    unsigned char data[NR_FRAME_SIZE];
+
+    nr_test_frame(data, id, tag);
+    nr_test_complete(dev->int_in_urbs[i], 0, data, NR_FRAME_SIZE);
+}
+
+//------------------------------------------------------------
+//                   FILTERS AND GROUPS
+//------------------------------------------------------------
+static void nr_test_filter_match(struct kunit *test)
+{
+    static const struct nr_can_filter masks[] = {
+        {0x100, 0x7f0}, // 0x100 to 0x10f
+    };
+    static const u32 ids[] = {0x7df, 0x7e8, NR_CAN_EFF_FLAG | 0x18db33f1};
+    struct nr_filter *filter;
+    int err;
+
+    filter = nr_filter_build(masks, ARRAY_SIZE(masks), ids, ARRAY_SIZE(ids),
+                             &err);
+    KUNIT_ASSERT_EQ(test, err, 0);
+    KUNIT_ASSERT_NOT_NULL(test, filter);
+    KUNIT_EXPECT_EQ(test, filter->n_ids, 3U);
+
+    KUNIT_EXPECT_TRUE(test, nr_filter_match(filter, 0x100));
+    KUNIT_EXPECT_TRUE(test, nr_filter_match(filter, 0x10f));
+    KUNIT_EXPECT_FALSE(test, nr_filter_match(filter, 0x110));
+    KUNIT_EXPECT_TRUE(test, nr_filter_match(filter, 0x7df));
+    KUNIT_EXPECT_TRUE(test, nr_filter_match(filter, 0x7e8));
+    KUNIT_EXPECT_FALSE(test, nr_filter_match(filter, 0x7e9));
+    KUNIT_EXPECT_TRUE(test,
+                      nr_filter_match(filter, NR_CAN_EFF_FLAG | 0x18db33f1));
+    // the same 29 bits without the flag are a different identifier
+    KUNIT_EXPECT_FALSE(test, nr_filter_match(filter, 0x18db33f1));
+    kvfree(filter);
+}
+
+static void nr_test_filter_build(struct kunit *test)
+{
+    static const u32 bad_sff[] = {0x800};
+    static const u32 bad_bits[] = {0x40000000};
+    static const u32 twice[] = {0x123, 0x123};
+    struct nr_filter *filter;
+    int err;
+
+    // empty: no filter at all
+    KUNIT_EXPECT_NULL(test, nr_filter_build(NULL, 0, NULL, 0, &err));
+    KUNIT_EXPECT_EQ(test, err, 0);
+
+    // identifiers nr_frame_can_id() can not give
+    KUNIT_EXPECT_NULL(test, nr_filter_build(NULL, 0, bad_sff, 1, &err));
+    KUNIT_EXPECT_EQ(test, err, -EINVAL);
+    KUNIT_EXPECT_NULL(test, nr_filter_build(NULL, 0, bad_bits, 1, &err));
+    KUNIT_EXPECT_EQ(test, err, -EINVAL);
+    KUNIT_EXPECT_NULL(test, nr_filter_build(NULL, NR_MAX_MASK_FILTERS + 1,
+                                            NULL, 0, &err));
+    KUNIT_EXPECT_EQ(test, err, -EINVAL);
+
+    // an identifier given twice is stored once
+    filter = nr_filter_build(NULL, 0, twice, 2, &err);
+    KUNIT_ASSERT_NOT_NULL(test, filter);
+    KUNIT_EXPECT_EQ(test, filter->n_ids, 1U);
+    kvfree(filter);
+}
+
+static void nr_test_group_pick(struct kunit *test)
+{
+    struct nr_group group = {
+        .id = 1,
+        .mode = NR_GROUP_ROUND_ROBIN,
+        .members = BIT_ULL(0) | BIT_ULL(2) | BIT_ULL(5),
+    };
+    int first;
+
+    // round robin, over the members accepting the frame only
+    KUNIT_EXPECT_EQ(test, nr_group_pick(&group, ~0ULL, 0x123), 0);
+    KUNIT_EXPECT_EQ(test, nr_group_pick(&group, ~0ULL, 0x123), 2);
+    KUNIT_EXPECT_EQ(test, nr_group_pick(&group, ~0ULL, 0x123), 5);
+    KUNIT_EXPECT_EQ(test, nr_group_pick(&group, ~0ULL, 0x123), 0);
+    group.next = 0;
+    KUNIT_EXPECT_EQ(test, nr_group_pick(&group, ~BIT_ULL(2), 0x123), 0);
+    KUNIT_EXPECT_EQ(test, nr_group_pick(&group, ~BIT_ULL(2), 0x123), 5);
+    KUNIT_EXPECT_EQ(test, nr_group_pick(&group, BIT_ULL(1), 0x123), -1);
+
+    // by identifier: always the same member for the same identifier
+    group.mode = NR_GROUP_HASH_ID;
+    first = nr_group_pick(&group, ~0ULL, 0x7df);
+    KUNIT_EXPECT_GE(test, first, 0);
+    KUNIT_EXPECT_EQ(test, nr_group_pick(&group, ~0ULL, 0x7df), first);
+    KUNIT_EXPECT_EQ(test, nr_group_pick(&group, ~0ULL, 0x7df), first);
+}
+
+static int nr_test_join(struct nr_file *file, u32 group, u32 mode)
+{
+    struct nr_group_req req = {.group = group, .mode = mode};
+
+    return nr_set_group(file, &req);
+}
+
+// a request that fails leaves the reader in the group it was in
+static void nr_test_set_group(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct nr_file *a = nr_test_open(test, FMODE_READ)->private_data;
+    struct nr_file *b = nr_test_open(test, FMODE_READ)->private_data;
+    struct nr_file *c = nr_test_open(test, FMODE_READ)->private_data;
+    struct nr_group *old;
+    unsigned int i;
+
+    KUNIT_ASSERT_EQ(test, nr_test_join(a, 1, NR_GROUP_ROUND_ROBIN), 0);
+    KUNIT_ASSERT_EQ(test, nr_test_join(b, 2, NR_GROUP_ROUND_ROBIN), 0);
+    old = b->group;
+
+    // group 1 does not share the frames that way
+    KUNIT_EXPECT_EQ(test, nr_test_join(b, 1, NR_GROUP_HASH_ID), -EINVAL);
+    KUNIT_EXPECT_PTR_EQ(test, b->group, old);
+    KUNIT_EXPECT_TRUE(test, old->members & BIT_ULL(b->rx_id));
+    KUNIT_EXPECT_FALSE(test, dev->rx_broadcast & BIT_ULL(b->rx_id));
+
+    // no group left for a new identifier
+    for (i = 0; i < NR_MAX_GROUPS; ++i)
+    {
+        if (dev->groups[i].members)
+            continue;
+        dev->groups[i].id = 100 + i;
+        dev->groups[i].members = BIT_ULL(NR_MAX_READERS - 1 - i);
+    }
+    KUNIT_EXPECT_EQ(test, nr_test_join(c, 3, NR_GROUP_ROUND_ROBIN), -ENOSPC);
+    KUNIT_EXPECT_NULL(test, c->group);
+    KUNIT_EXPECT_TRUE(test, dev->rx_broadcast & BIT_ULL(c->rx_id));
+
+    // but b is alone in its group, which becomes group 3
+    KUNIT_EXPECT_EQ(test, nr_test_join(b, 3, NR_GROUP_HASH_ID), 0);
+    KUNIT_EXPECT_PTR_EQ(test, b->group, old);
+    KUNIT_EXPECT_EQ(test, old->id, 3U);
+    KUNIT_EXPECT_EQ(test, old->mode, (u32)NR_GROUP_HASH_ID);
+
+    // joining a, its former group is free again
+    KUNIT_EXPECT_EQ(test, nr_test_join(b, 1, NR_GROUP_ROUND_ROBIN), 0);
+    KUNIT_EXPECT_PTR_EQ(test, b->group, a->group);
+    KUNIT_EXPECT_EQ(test, old->members, 0ULL);
+    KUNIT_EXPECT_EQ(test, nr_test_join(b, 0, NR_GROUP_ROUND_ROBIN), 0);
+    KUNIT_EXPECT_NULL(test, b->group);
+    KUNIT_EXPECT_TRUE(test, dev->rx_broadcast & BIT_ULL(b->rx_id));
+}
+
+static void nr_test_bpf_check(struct kunit *test)
+{
+    struct sock_filter prog[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4),
+        BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_filter unaligned[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 2),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_filter outside[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, NR_FRAME_SIZE),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_filter byte[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 4),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_filter indirect[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_IND, 0),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+
+    // the loads become loads from the report, the length is the one of a
+    //   report
+    KUNIT_EXPECT_EQ(test, nr_bpf_check(prog, ARRAY_SIZE(prog)), 0);
+    KUNIT_EXPECT_EQ(test, prog[0].code, BPF_LDX | BPF_W | BPF_ABS);
+    KUNIT_EXPECT_EQ(test, prog[0].k, 4U);
+    KUNIT_EXPECT_EQ(test, prog[1].code, BPF_LD | BPF_IMM);
+    KUNIT_EXPECT_EQ(test, prog[1].k, (u32)NR_FRAME_SIZE);
+
+    // everything that would need a socket buffer
+    KUNIT_EXPECT_EQ(test, nr_bpf_check(unaligned, ARRAY_SIZE(unaligned)),
+                    -EINVAL);
+    KUNIT_EXPECT_EQ(test, nr_bpf_check(outside, ARRAY_SIZE(outside)),
+                    -EINVAL);
+    KUNIT_EXPECT_EQ(test, nr_bpf_check(byte, ARRAY_SIZE(byte)), -EINVAL);
+    KUNIT_EXPECT_EQ(test, nr_bpf_check(indirect, ARRAY_SIZE(indirect)),
+                    -EINVAL);
+}
+
+//------------------------------------------------------------
+//                  RECEIVE PATH
+//------------------------------------------------------------
+// the frames are given back in the order the urbs complete, whatever the
+//   order they were submitted in, and every urb goes back in flight
+static void nr_test_rx_order(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct nr_file *file = nr_test_open(test, FMODE_READ)->private_data;
+    unsigned char frame[NR_FRAME_SIZE];
+    struct nr_rx_header hdr;
+    unsigned int i;
+
+    KUNIT_EXPECT_EQ(test, nr_test_submitted, (unsigned int)NR_TEST_IN_URBS);
+    nr_test_receive(dev, 2, 0x100, 'a');
+    nr_test_receive(dev, 0, 0x100, 'b');
+    nr_test_receive(dev, 1, 0x100, 'c');
+    for (i = 0; i < NR_TEST_IN_URBS; ++i)
+        KUNIT_EXPECT_TRUE(test, nr_test_in_flight(dev->int_in_urbs[i]));
+    KUNIT_EXPECT_EQ(test, nr_test_submitted, 2U * NR_TEST_IN_URBS);
+
+    for (i = 0; i < 3; ++i)
+    {
+        KUNIT_ASSERT_EQ(test, nr_rx_take(file, frame, NR_FRAME_SIZE, &hdr),
+                        (ssize_t)NR_FRAME_SIZE);
+        KUNIT_EXPECT_EQ(test, frame[NR_FRAME_DATA], "abc"[i]);
+        KUNIT_EXPECT_EQ(test, hdr.seq, i);
+    }
+    KUNIT_EXPECT_EQ(test, nr_rx_take(file, frame, NR_FRAME_SIZE, &hdr),
+                    (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, atomic_long_read(&dev->stats.rx_frames), 3L);
+}
+
+// an empty report is not queued, the urb goes back in flight
+static void nr_test_rx_empty(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct file *filp = nr_test_open(test, FMODE_READ);
+    struct nr_file *file = filp->private_data;
+    unsigned char buf[NR_FRAME_SIZE];
+
+    nr_test_complete(dev->int_in_urbs[0], 0, NULL, 0);
+    KUNIT_EXPECT_TRUE(test, nr_test_in_flight(dev->int_in_urbs[0]));
+    KUNIT_EXPECT_EQ(test, dev->rx_head, 0U);
+    KUNIT_EXPECT_EQ(test, file->rx_pending, 0U);
+
+    // the next frame is read as usual
+    nr_test_receive(dev, 1, 0x100, 'a');
+    KUNIT_EXPECT_EQ(test, nr_test_read(filp, buf, sizeof(buf)),
+                    (ssize_t)NR_FRAME_SIZE);
+    KUNIT_EXPECT_EQ(test, buf[NR_FRAME_DATA], 'a');
+}
+
+// a frame longer than the room left stays in the ring
+static void nr_test_rx_take_room(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct nr_file *file = nr_test_open(test, FMODE_READ)->private_data;
+    unsigned char frame[NR_FRAME_SIZE];
+    struct nr_rx_header hdr;
+
+    nr_test_receive(t->dev, 0, 0x100, 'a');
+    KUNIT_EXPECT_EQ(test, nr_rx_take(file, frame, 8, &hdr), (ssize_t)-ENOSPC);
+    KUNIT_EXPECT_EQ(test, nr_rx_take(file, frame, NR_FRAME_SIZE, &hdr),
+                    (ssize_t)NR_FRAME_SIZE);
+}
+
+// only the readers whose filters accept a frame get it
+static void nr_test_rx_filter(struct kunit *test)
+{
+    static const u32 ids[] = {0x200};
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct nr_file *all = nr_test_open(test, FMODE_READ)->private_data;
+    struct nr_file *some = nr_test_open(test, FMODE_READ)->private_data;
+    unsigned char frame[NR_FRAME_SIZE];
+    struct nr_rx_header hdr;
+    int err;
+
+    some->filter = nr_filter_build(NULL, 0, ids, 1, &err);
+    KUNIT_ASSERT_NOT_NULL(test, some->filter);
+    spin_lock_irq(&dev->int_in_lock);
+    nr_file_filtered(some);
+    spin_unlock_irq(&dev->int_in_lock);
+
+    nr_test_receive(dev, 0, 0x100, 'a');
+    nr_test_receive(dev, 1, 0x200, 'b');
+    KUNIT_EXPECT_EQ(test, all->rx_pending, 2U);
+    KUNIT_EXPECT_EQ(test, some->rx_pending, 1U);
+    KUNIT_ASSERT_EQ(test, nr_rx_take(some, frame, NR_FRAME_SIZE, &hdr),
+                    (ssize_t)NR_FRAME_SIZE);
+    KUNIT_EXPECT_EQ(test, frame[NR_FRAME_DATA], 'b');
+    KUNIT_EXPECT_EQ(test, hdr.seq, 1U);
+}
+
+// the completion handler never waits for a slow reader: it overwrites the
+//   oldest frames, which the reader counts as lost
+static void nr_test_rx_overflow(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct nr_file *file = nr_test_open(test, FMODE_READ)->private_data;
+    unsigned int n = dev->rx_ring_size + 3, i;
+    unsigned char frame[NR_FRAME_SIZE];
+    struct nr_rx_header hdr;
+
+    for (i = 0; i < n; ++i)
+        nr_test_receive(dev, i % NR_TEST_IN_URBS, 0x100, i);
+
+    // the reader finds the newest rx_ring_size frames
+    for (i = 3; i < n; ++i)
+    {
+        KUNIT_ASSERT_EQ(test, nr_rx_take(file, frame, NR_FRAME_SIZE, &hdr),
+                        (ssize_t)NR_FRAME_SIZE);
+        KUNIT_EXPECT_EQ(test, hdr.seq, i);
+        KUNIT_EXPECT_EQ(test, frame[NR_FRAME_DATA], (unsigned char)i);
+    }
+    KUNIT_EXPECT_EQ(test, nr_rx_take(file, frame, NR_FRAME_SIZE, &hdr),
+                    (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, file->rx_overruns, 3UL);
+    KUNIT_EXPECT_EQ(test, atomic_long_read(&dev->stats.rx_overruns), 3L);
+    KUNIT_EXPECT_EQ(test, file->rx_pending, 0U);
+}
+
+// what the completion handler does with each status
+static void nr_test_rx_status(struct kunit *test)
+{
+    static const struct
+    {
+        int status;
+        bool error;
+        bool resubmit;
+    } cases[] = {
+        // unlinked (usb_kill_urb(), usb_poison_urb(), disconnect)
+        {-ENOENT, false, false},
+        {-ECONNRESET, false, false},
+        {-ESHUTDOWN, false, false},
+        // the device does not answer any more
+        {-EPROTO, true, false},
+        {-EILSEQ, true, false},
+        {-ETIME, true, false},
+        // anything else is retried
+        {-EOVERFLOW, true, true},
+    };
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct nr_file *file = nr_test_open(test, FMODE_READ)->private_data;
+    struct urb *urb = dev->int_in_urbs[0];
+    long errors;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); ++i)
+    {
+        // back in flight for the next case
+        if (!nr_test_in_flight(urb))
+            KUNIT_ASSERT_EQ(test, nr_submit_in_urb(dev, urb, GFP_KERNEL), 0);
+        errors = atomic_long_read(&dev->stats.rx_errors);
+
+        nr_test_complete(urb, cases[i].status, NULL, 0);
+        KUNIT_EXPECT_EQ_MSG(test, nr_test_in_flight(urb), cases[i].resubmit,
+                            "status %d", cases[i].status);
+        KUNIT_EXPECT_EQ_MSG(test, atomic_long_read(&dev->stats.rx_errors),
+                            errors + cases[i].error, "status %d",
+                            cases[i].status);
+        KUNIT_EXPECT_EQ(test, file->rx_pending, 0U);
+    }
+}
+
+// a stalled endpoint is cleared from the work, not from the handler
+static void nr_test_rx_stall(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct urb *urb = dev->int_in_urbs[1];
+
+    nr_test_complete(urb, -EPIPE, NULL, 0);
+    KUNIT_EXPECT_FALSE(test, nr_test_in_flight(urb));
+    KUNIT_EXPECT_TRUE(test, test_bit(1, &dev->in_halted));
+    flush_work(&dev->in_halt_work);
+    KUNIT_EXPECT_EQ(test, atomic_read(&nr_test_halts), 1);
+}
+
+// a failed resubmission leaves the urb out of flight, without a frame
+static void nr_test_rx_resubmit_fails(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct nr_file *file = nr_test_open(test, FMODE_READ)->private_data;
+
+    nr_test_submit_error = -ENODEV;
+    nr_test_receive(dev, 0, 0x100, 'a');
+    KUNIT_EXPECT_FALSE(test, nr_test_in_flight(dev->int_in_urbs[0]));
+    // the frame itself was received
+    KUNIT_EXPECT_EQ(test, file->rx_pending, 1U);
+}
+
+//------------------------------------------------------------
+//                          READ
+//------------------------------------------------------------
+static void nr_test_read_frames(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct file *filp = nr_test_open(test, FMODE_READ);
+    struct nr_file *file = filp->private_data;
+    unsigned char buf[2 * (sizeof(struct nr_rx_header) + NR_FRAME_SIZE)];
+    struct nr_rx_header hdr;
+
+    nr_test_receive(t->dev, 0, 0x100, 'a');
+    nr_test_receive(t->dev, 1, 0x100, 'b');
+
+    // a read() of 0 bytes returns at once and takes nothing
+    KUNIT_EXPECT_EQ(test, nr_test_read(filp, buf, 0), (ssize_t)0);
+    KUNIT_EXPECT_EQ(test, file->rx_pending, 2U);
+
+    // with the headers, both frames at once
+    file->rx_tstamp = NR_TSTAMP_MONOTONIC;
+    KUNIT_ASSERT_EQ(test, nr_test_read(filp, buf, sizeof(buf)),
+                    (ssize_t)sizeof(buf));
+    memcpy(&hdr, buf + sizeof(hdr) + NR_FRAME_SIZE, sizeof(hdr));
+    KUNIT_EXPECT_EQ(test, hdr.seq, 1U);
+    KUNIT_EXPECT_EQ(test, hdr.len, (u16)NR_FRAME_SIZE);
+    KUNIT_EXPECT_EQ(test, buf[2 * sizeof(hdr) + NR_FRAME_SIZE +
+                              NR_FRAME_DATA], 'b');
+
+    // a buffer that can not hold a whole record
+    KUNIT_EXPECT_EQ(test, nr_test_read(filp, buf, NR_FRAME_SIZE),
+                    (ssize_t)-EINVAL);
+}
+
+// a non-blocking read() of an empty ring, and a blocking one interrupted by
+//   a signal
+static void nr_test_read_wait(struct kunit *test)
+{
+    struct file *filp = nr_test_open(test, FMODE_READ);
+    unsigned char buf[NR_FRAME_SIZE];
+    ssize_t rs;
+
+    filp->f_flags |= O_NONBLOCK;
+    KUNIT_EXPECT_EQ(test, nr_test_read(filp, buf, sizeof(buf)),
+                    (ssize_t)-EAGAIN);
+    filp->f_flags &= ~O_NONBLOCK;
+
+    // no real signal: the flag is enough for wait_event_interruptible()
+    set_tsk_thread_flag(current, TIF_SIGPENDING);
+    rs = nr_test_read(filp, buf, sizeof(buf));
+    clear_tsk_thread_flag(current, TIF_SIGPENDING);
+    KUNIT_EXPECT_EQ(test, rs, (ssize_t)-ERESTARTSYS);
+}
+
+//------------------------------------------------------------
+//                    WRITE AND FLUSH
+//------------------------------------------------------------
+// the error of a frame goes to the file that wrote it, and flush() only
+//   waits for the frames of its own file
+static void nr_test_write_owner(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct file *a = nr_test_open(test, FMODE_WRITE);
+    struct file *b = nr_test_open(test, FMODE_WRITE);
+    struct nr_file *fa = a->private_data;
+    struct nr_file *fb = b->private_data;
+    unsigned char data[NR_FRAME_SIZE] = {NR_CMD_TX};
+    struct urb *urb;
+
+    KUNIT_ASSERT_EQ(test, nr_test_write(a, data, sizeof(data)),
+                    (ssize_t)sizeof(data));
+    KUNIT_EXPECT_EQ(test, fa->tx_inflight, 1U);
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, NR_TEST_OUT_URBS - 1U);
+    urb = dev->int_out_urbs[NR_TEST_OUT_URBS - 1];
+    KUNIT_ASSERT_TRUE(test, nr_test_in_flight(urb));
+
+    // b has nothing in flight: its close() does not wait for a
+    KUNIT_EXPECT_EQ(test, nr_flush(b, NULL), 0);
+
+    nr_test_complete(urb, -EPROTO, NULL, 0);
+    KUNIT_EXPECT_EQ(test, fa->tx_inflight, 0U);
+    KUNIT_EXPECT_EQ(test, fa->tx_error, -EPROTO);
+    KUNIT_EXPECT_EQ(test, fb->tx_error, 0);
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, (unsigned int)NR_TEST_OUT_URBS);
+
+    // reported once, by the next write() of a
+    KUNIT_EXPECT_EQ(test, nr_test_write(b, data, sizeof(data)),
+                    (ssize_t)sizeof(data));
+    KUNIT_EXPECT_EQ(test, nr_test_write(a, data, sizeof(data)),
+                    (ssize_t)-EPROTO);
+    KUNIT_EXPECT_EQ(test, nr_test_write(a, data, sizeof(data)),
+                    (ssize_t)sizeof(data));
+
+    // an unlink is not an error
+    nr_test_complete(dev->int_out_urbs[0], -ESHUTDOWN, NULL, 0);
+    nr_test_complete(dev->int_out_urbs[1], -ENOENT, NULL, 0);
+    KUNIT_EXPECT_EQ(test, nr_flush(a, NULL), 0);
+    KUNIT_EXPECT_EQ(test, nr_flush(b, NULL), 0);
+}
+
+// a batch of whole frames, cut short by a failed submission
+static void nr_test_write_batch(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct file *filp = nr_test_open(test, FMODE_WRITE);
+    struct nr_file *file = filp->private_data;
+    unsigned char data[2 * NR_FRAME_SIZE] = {0};
+
+    KUNIT_EXPECT_EQ(test, nr_test_write(filp, data, NR_FRAME_SIZE + 1),
+                    (ssize_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, nr_test_write(filp, data, sizeof(data)),
+                    (ssize_t)sizeof(data));
+    KUNIT_EXPECT_EQ(test, file->tx_inflight, 2U);
+    nr_test_complete(dev->int_out_urbs[0], 0, NULL, 0);
+    nr_test_complete(dev->int_out_urbs[1], 0, NULL, 0);
+    KUNIT_EXPECT_EQ(test, atomic_long_read(&dev->stats.tx_frames), 2L);
+
+    // the first frame is queued, the second one can not be submitted: the
+    //   write() is short, by whole frames
+    nr_test_submit_limit = nr_test_submitted + 1;
+    nr_test_submit_error = -EPROTO;
+    KUNIT_EXPECT_EQ(test, nr_test_write(filp, data, sizeof(data)),
+                    (ssize_t)NR_FRAME_SIZE);
+    KUNIT_EXPECT_EQ(test, file->tx_inflight, 1U);
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, NR_TEST_OUT_URBS - 1U);
+
+    // and nothing at all once no urb can be submitted
+    KUNIT_ASSERT_TRUE(test, nr_test_in_flight(dev->int_out_urbs[1]));
+    nr_test_complete(dev->int_out_urbs[1], 0, NULL, 0);
+    KUNIT_EXPECT_EQ(test, nr_test_write(filp, data, sizeof(data)),
+                    (ssize_t)-EPROTO);
+    KUNIT_EXPECT_EQ(test, file->tx_inflight, 0U);
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, (unsigned int)NR_TEST_OUT_URBS);
+}
+
+// The completions drain the transmit ring, but not after a status telling the
+//   device does not answer any more: every frame would fail the same way.
+static void nr_test_tx_ring_error(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    unsigned int i;
+
+    for (i = 0; i < dev->tx_ring_size; ++i)
+        dev->tx_slots[i].len = NR_FRAME_SIZE;
+
+    // the doorbell sends the first two frames
+    smp_store_release(&dev->tx_ring->head, 2);
+    nr_tx_ring_drain(dev);
+    KUNIT_EXPECT_EQ(test, dev->tx_tail, 2U);
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, 0U);
+
+    // two more frames are queued, the first completion fails for good
+    smp_store_release(&dev->tx_ring->head, 4);
+    nr_test_complete(dev->int_out_urbs[0], -EPROTO, NULL, 0);
+    KUNIT_EXPECT_EQ(test, dev->tx_tail, 2U);
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, 1U);
+    KUNIT_EXPECT_EQ(test, nr_take_tx_error(dev), -EPROTO);
+
+    // the next successful one sends them
+    nr_test_complete(dev->int_out_urbs[1], 0, NULL, 0);
+    KUNIT_EXPECT_EQ(test, dev->tx_tail, 4U);
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, 0U);
+}
+
+// a non-blocking write() with the pool empty, and a blocking one interrupted
+//   by a signal
+static void nr_test_write_wait(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct file *filp = nr_test_open(test, FMODE_WRITE);
+    unsigned char data[NR_FRAME_SIZE] = {0};
+    unsigned int free = dev->tx_free_count;
+    ssize_t rs;
+
+    dev->tx_free_count = 0;
+    filp->f_flags |= O_NONBLOCK;
+    KUNIT_EXPECT_EQ(test, nr_test_write(filp, data, sizeof(data)),
+                    (ssize_t)-EAGAIN);
+    filp->f_flags &= ~O_NONBLOCK;
+
+    set_tsk_thread_flag(current, TIF_SIGPENDING);
+    rs = nr_test_write(filp, data, sizeof(data));
+    clear_tsk_thread_flag(current, TIF_SIGPENDING);
+    KUNIT_EXPECT_EQ(test, rs, (ssize_t)-ERESTARTSYS);
+    dev->tx_free_count = free;
+}
+
+//------------------------------------------------------------
+//                        DISCONNECT
+//------------------------------------------------------------
+static int nr_test_disconnect_thread(void *data)
+{
+    struct nr_test *t = data;
+
+    nr_disconnect(&t->intf);
+    complete(&t->disconnected);
+    return 0;
+}
+
+// The device goes away with urbs in flight. disconnect() poisons them (they
+//   complete with -ESHUTDOWN and can not be resubmitted), waits for the OUT
+//   urb still in flight, frees the urbs and drops the reference of the
+//   interface. The frames already received can still be read, then
+//   everything fails with -ENODEV.
+static void nr_test_disconnect(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct file *reader = nr_test_open(test, FMODE_READ);
+    struct file *writer = nr_test_open(test, FMODE_WRITE);
+    struct urb *out = dev->int_out_urbs[NR_TEST_OUT_URBS - 1];
+    unsigned char data[NR_FRAME_SIZE] = {0};
+    struct task_struct *thread;
+    unsigned int i;
+
+    nr_test_receive(dev, 0, 0x100, 'a');
+    KUNIT_ASSERT_EQ(test, nr_test_write(writer, data, sizeof(data)),
+                    (ssize_t)sizeof(data));
+    KUNIT_ASSERT_TRUE(test, nr_test_in_flight(out));
+
+    // disconnect() sleeps until the OUT urb comes back
+    thread = kthread_run(nr_test_disconnect_thread, t, "nr_test_disconnect");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(thread));
+
+    // the last urb poisoned is the last OUT one
+    for (i = 0; i < 1000 && !atomic_read(&out->reject); ++i)
+        msleep(1);
+    KUNIT_EXPECT_TRUE(test, READ_ONCE(dev->disconnected));
+    KUNIT_EXPECT_GT(test, atomic_read(&out->reject), 0);
+    KUNIT_EXPECT_FALSE(test, completion_done(&t->disconnected));
+
+    // the IN urbs are killed, nothing goes back in flight
+    for (i = 0; i < NR_TEST_IN_URBS; ++i)
+    {
+        nr_test_complete(dev->int_in_urbs[i], -ESHUTDOWN, NULL, 0);
+        KUNIT_EXPECT_FALSE(test, nr_test_in_flight(dev->int_in_urbs[i]));
+    }
+    KUNIT_EXPECT_EQ(test, nr_submit_in_urb(dev, dev->int_in_urbs[0],
+                                           GFP_KERNEL), -EPERM);
+
+    // flush() does not wait for a frame that will never complete, and no
+    //   frame can be written any more
+    KUNIT_EXPECT_EQ(test, nr_flush(writer, NULL), 0);
+    KUNIT_EXPECT_EQ(test, nr_test_write(writer, data, sizeof(data)),
+                    (ssize_t)-ENODEV);
+
+    nr_test_complete(out, -ESHUTDOWN, NULL, 0);
+    wait_for_completion(&t->disconnected);
+
+    // the urbs are gone, the open files keep the device
+    KUNIT_EXPECT_EQ(test, dev->n_in_urbs, 0U);
+    KUNIT_EXPECT_EQ(test, dev->n_out_urbs, 0U);
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, 0U);
+    KUNIT_EXPECT_EQ(test, kref_read(&dev->kref), t->n_files);
+    KUNIT_EXPECT_NULL(test, usb_get_intfdata(&t->intf));
+
+    KUNIT_EXPECT_EQ(test, nr_test_read(reader, data, sizeof(data)),
+                    (ssize_t)NR_FRAME_SIZE);
+    KUNIT_EXPECT_EQ(test, data[NR_FRAME_DATA], 'a');
+    KUNIT_EXPECT_EQ(test, nr_test_read(reader, data, sizeof(data)),
+                    (ssize_t)-ENODEV);
+    KUNIT_EXPECT_EQ(test, nr_test_write(writer, data, sizeof(data)),
+                    (ssize_t)-ENODEV);
+}
+
+// A write() holds an urb of the pool (filling its buffer) when the device is
+//   unplugged: disconnect() waits for it, and nobody can take an urb from the
+//   pool in the meantime, neither write() nor the doorbell.
+static void nr_test_disconnect_held_urb(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct urb *held, *out = dev->int_out_urbs[NR_TEST_OUT_URBS - 1];
+    struct task_struct *thread;
+    unsigned int i;
+
+    held = nr_get_tx_urb(dev);
+    KUNIT_ASSERT_NOT_NULL(test, held);
+
+    thread = kthread_run(nr_test_disconnect_thread, t, "nr_test_disconnect");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(thread));
+    for (i = 0; i < 1000 && !atomic_read(&out->reject); ++i)
+        msleep(1);
+    for (i = 0; i < NR_TEST_IN_URBS; ++i)
+        nr_test_complete(dev->int_in_urbs[i], -ESHUTDOWN, NULL, 0);
+
+    // the other urb is still in the pool, but can not be taken any more
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, NR_TEST_OUT_URBS - 1U);
+    KUNIT_EXPECT_NULL(test, nr_get_tx_urb(dev));
+    KUNIT_EXPECT_FALSE(test, completion_done(&t->disconnected));
+
+    // the submission of the held urb failed, write() gives it back
+    nr_put_tx_urb(dev, held);
+    wait_for_completion(&t->disconnected);
+    KUNIT_EXPECT_EQ(test, dev->tx_free_count, 0U);
+    KUNIT_EXPECT_EQ(test, dev->n_out_urbs, 0U);
+
+    // a doorbell that checked dev->disconnected too early finds the pool empty
+    smp_store_release(&dev->tx_ring->head, 1);
+    nr_tx_ring_drain(dev);
+    KUNIT_EXPECT_EQ(test, dev->tx_tail, 0U);
+    KUNIT_EXPECT_NULL(test, nr_get_tx_urb(dev));
+}
+
+//------------------------------------------------------------
+//                       BENCHMARKS
+//------------------------------------------------------------
+#define NR_TEST_BENCH_FRAMES 100000
+
+// a frame received by the completion handler and taken by a reader
+static void nr_test_bench_rx(struct kunit *test)
+{
+    struct nr_test *t = test->priv;
+    struct usb_nr *dev = t->dev;
+    struct nr_file *file = nr_test_open(test, FMODE_READ)->private_data;
+    unsigned char data[NR_FRAME_SIZE], frame[NR_FRAME_SIZE];
+    struct nr_rx_header hdr;
+    ktime_t start;
+    s64 ns;
+    unsigned int i;
+
+    nr_test_frame(data, 0x100, 0);
+    start = ktime_get();
+    for (i = 0; i < NR_TEST_BENCH_FRAMES; ++i)
+    {
+        nr_test_complete(dev->int_in_urbs[0], 0, data, NR_FRAME_SIZE);
+        nr_rx_take(file, frame, NR_FRAME_SIZE, &hdr);
+    }
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    KUNIT_EXPECT_EQ(test, file->rx_frames, (unsigned long)NR_TEST_BENCH_FRAMES);
+    kunit_info(test, "receive and take: %lld ns/frame\n",
+               div_s64(ns, NR_TEST_BENCH_FRAMES));
+}
+
+// a lookup among the largest list of identifiers
+static void nr_test_bench_filter(struct kunit *test)
+{
+    struct nr_filter *filter;
+    unsigned int i, hits = 0;
+    ktime_t start;
+    u32 *ids;
+    s64 ns;
+    int err;
+
+    ids = kunit_kmalloc_array(test, NR_MAX_ID_FILTERS, sizeof(u32),
+                              GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, ids);
+    for (i = 0; i < NR_MAX_ID_FILTERS; ++i)
+        ids[i] = NR_CAN_EFF_FLAG | (i * 7919);
+    filter = nr_filter_build(NULL, 0, ids, NR_MAX_ID_FILTERS, &err);
+    KUNIT_ASSERT_NOT_NULL(test, filter);
+
+    start = ktime_get();
+    for (i = 0; i < NR_TEST_BENCH_FRAMES; ++i)
+        hits += nr_filter_match(filter, NR_CAN_EFF_FLAG | (i * 7919));
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    KUNIT_EXPECT_EQ(test, hits, (unsigned int)NR_MAX_ID_FILTERS);
+    kunit_info(test, "filter lookup (%d ids): %lld ns\n", NR_MAX_ID_FILTERS,
+               div_s64(ns, NR_TEST_BENCH_FRAMES));
+    kvfree(filter);
+}
+
+static struct kunit_case nr_test_cases[] = {
+    KUNIT_CASE(nr_test_filter_match),
+    KUNIT_CASE(nr_test_filter_build),
+    KUNIT_CASE(nr_test_group_pick),
+    KUNIT_CASE(nr_test_set_group),
+    KUNIT_CASE(nr_test_bpf_check),
+    KUNIT_CASE(nr_test_rx_order),
+    KUNIT_CASE(nr_test_rx_empty),
+    KUNIT_CASE(nr_test_rx_take_room),
+    KUNIT_CASE(nr_test_rx_filter),
+    KUNIT_CASE(nr_test_rx_overflow),
+    KUNIT_CASE(nr_test_rx_status),
+    KUNIT_CASE(nr_test_rx_stall),
+    KUNIT_CASE(nr_test_rx_resubmit_fails),
+    KUNIT_CASE(nr_test_read_frames),
+    KUNIT_CASE(nr_test_read_wait),
+    KUNIT_CASE(nr_test_write_owner),
+    KUNIT_CASE(nr_test_write_batch),
+    KUNIT_CASE(nr_test_tx_ring_error),
+    KUNIT_CASE(nr_test_write_wait),
+    KUNIT_CASE(nr_test_disconnect),
+    KUNIT_CASE(nr_test_disconnect_held_urb),
+    KUNIT_CASE(nr_test_bench_rx),
+    KUNIT_CASE(nr_test_bench_filter),
+    {}
+};
+
+static struct kunit_suite nr_test_suite = {
+    .name = "nr_driver",
+    .init = nr_test_init,
+    .exit = nr_test_exit,
+    .test_cases = nr_test_cases,
+};
+
+kunit_test_suite(nr_test_suite);
@@ -0,0 +1,465 @@
+/*
+ * Software emulator of the 04d8:0070 CAN bridge, to run the driver without
+ * the adapter. It is the device side of a USB gadget made with FunctionFS:
+ * with the dummy_hcd module the gadget is plugged into the same machine and
+ * nr_driver binds to it as to the real adapter (see nr_emulator_setup.sh,
+ * which builds the gadget and starts this program).
+ *
+ * The emulated adapter has, as the real one, one interface with an interrupt
+ * IN and an interrupt OUT endpoint of 64 bytes. It
+ *      - sends back on the IN endpoint every report received on the OUT
+ *        endpoint, as the adapter does in loopback mode (unless -n),
+ *      - generates CAN reports on the IN endpoint at a given rate (-r), laid
+ *        out as the ones of the adapter (see nr_driver.h).
+ *
+ * Usage: nr_emulator [options] <functionfs mount point>
+ *      -r rate     reports generated per second (default 0: none)
+ *      -b burst    reports generated at once, every burst / rate seconds
+ *                  (default 1)
+ *      -p pattern  counter: identifier -i, the data is a 64 bits counter
+ *                  fixed:   identifier -i, always the same data
+ *                  random:  random identifier, length and data
+ *                  (default counter)
+ *      -i id       CAN identifier of the counter and fixed patterns
+ *                  (default 0x123)
+ *      -x          extended (29 bits) identifiers
+ *      -n          no loopback of the reports received
+ *      -v          print the number of reports sent and received every
+ *                  second
+ *
+ * Build: make tools
+ */
+
+#include <byteswap.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#include "nr_driver.h" // layout of the reports
+
+// htole16() and htole32() as constant expressions, for the initializers
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define NR_LE16(x) (x)
+#define NR_LE32(x) (x)
+#else
+#define NR_LE16(x) __bswap_constant_16(x)
+#define NR_LE32(x) __bswap_constant_32(x)
+#endif
+
+//------------------------------------------------------------
+//                       DESCRIPTORS
+//------------------------------------------------------------
+// written to ep0 before the gadget is bound: one interface, the IN endpoint
+//   (ep1 in the mount point) then the OUT endpoint (ep2), at full and high
+//   speed
+
+struct nr_function_desc
+{
+    struct usb_interface_descriptor intf;
+    struct usb_endpoint_descriptor_no_audio in;
+    struct usb_endpoint_descriptor_no_audio out;
+} __attribute__((packed));
+
+static const struct
+{
+    struct usb_functionfs_descs_head_v2 header;
+    __le32 fs_count;
+    __le32 hs_count;
+    struct nr_function_desc fs;
+    struct nr_function_desc hs;
+} __attribute__((packed)) descriptors = {
+    .header = {
+        .magic = NR_LE32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+        .flags = NR_LE32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC),
+        .length = NR_LE32(sizeof(descriptors)),
+    },
+    .fs_count = NR_LE32(3),
+    .hs_count = NR_LE32(3),
+    .fs = {
+        .intf = {
+            .bLength = sizeof(descriptors.fs.intf),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+            .iInterface = 1,
+        },
+        .in = {
+            .bLength = sizeof(descriptors.fs.in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = 1 | USB_DIR_IN,
+            .bmAttributes = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize = NR_LE16(NR_FRAME_SIZE),
+            .bInterval = 1, // 1 ms
+        },
+        .out = {
+            .bLength = sizeof(descriptors.fs.out),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = 2 | USB_DIR_OUT,
+            .bmAttributes = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize = NR_LE16(NR_FRAME_SIZE),
+            .bInterval = 1,
+        },
+    },
+    .hs = {
+        .intf = {
+            .bLength = sizeof(descriptors.hs.intf),
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bNumEndpoints = 2,
+            .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+            .iInterface = 1,
+        },
+        .in = {
+            .bLength = sizeof(descriptors.hs.in),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = 1 | USB_DIR_IN,
+            .bmAttributes = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize = NR_LE16(NR_FRAME_SIZE),
+            .bInterval = 1, // 2^(1-1) microframes: 125 us
+        },
+        .out = {
+            .bLength = sizeof(descriptors.hs.out),
+            .bDescriptorType = USB_DT_ENDPOINT,
+            .bEndpointAddress = 2 | USB_DIR_OUT,
+            .bmAttributes = USB_ENDPOINT_XFER_INT,
+            .wMaxPacketSize = NR_LE16(NR_FRAME_SIZE),
+            .bInterval = 1,
+        },
+    },
+};
+
+#define NR_INTERFACE_NAME "nr_driver emulator"
+
+static const struct
+{
+    struct usb_functionfs_strings_head header;
+    struct
+    {
+        __le16 code;
+        const char str1[sizeof(NR_INTERFACE_NAME)];
+    } __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+    .header = {
+        .magic = NR_LE32(FUNCTIONFS_STRINGS_MAGIC),
+        .length = NR_LE32(sizeof(strings)),
+        .str_count = NR_LE32(1),
+        .lang_count = NR_LE32(1),
+    },
+    .lang0 = {
+        NR_LE16(0x0409), // en-us
+        NR_INTERFACE_NAME,
+    },
+};
+
+//------------------------------------------------------------
+//                         SETTINGS
+//------------------------------------------------------------
+enum nr_pattern
+{
+    NR_PATTERN_COUNTER,
+    NR_PATTERN_FIXED,
+    NR_PATTERN_RANDOM,
+};
+
+static unsigned long rate;
+static unsigned int burst = 1;
+static enum nr_pattern pattern = NR_PATTERN_COUNTER;
+static uint32_t can_id = 0x123;
+static bool extended;
+static bool loopback = true;
+static bool verbose;
+
+// files of the endpoints
+static int ep0, ep_in, ep_out;
+
+// the generator and the loopback both send on the IN endpoint, a report is
+//   written at once
+static pthread_mutex_t in_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// counters printed with -v
+static unsigned long sent, received;
+
+//------------------------------------------------------------
+//                         REPORTS
+//------------------------------------------------------------
+// Build a report carrying a CAN frame, laid out as the MCP2515 registers
+//   (the opposite of nr_frame_can_id()).
+static void nr_build_report(uint8_t *data, uint32_t id, bool eff,
+                            const uint8_t *payload, unsigned int len)
+{
+    uint32_t sid;
+
+    memset(data, 0, NR_FRAME_SIZE);
+    if (eff)
+    {
+        sid = (id >> 18) & 0x7ff;
+        data[NR_FRAME_SIDL] = NR_SIDL_EXIDE | ((id >> 16) & 0x03);
+        data[NR_FRAME_EID8] = id >> 8;
+        data[NR_FRAME_EID0] = id;
+    }
+    else
+    {
+        sid = id & 0x7ff;
+    }
+    data[NR_FRAME_SIDH] = sid >> 3;
+    data[NR_FRAME_SIDL] |= (sid & 0x07) << 5;
+    data[NR_FRAME_DLC] = len;
+    memcpy(&data[NR_FRAME_DATA], payload, len);
+}
+
+// the next report of the pattern
+static void nr_next_report(uint8_t *data, uint64_t seq)
+{
+    uint8_t payload[8];
+    unsigned int len, i;
+    uint64_t le;
+
+    switch (pattern)
+    {
+    case NR_PATTERN_COUNTER:
+        le = htole64(seq);
+        memcpy(payload, &le, sizeof(payload));
+        nr_build_report(data, can_id, extended, payload, sizeof(payload));
+        break;
+    case NR_PATTERN_FIXED:
+        memset(payload, 0x55, sizeof(payload));
+        nr_build_report(data, can_id, extended, payload, sizeof(payload));
+        break;
+    case NR_PATTERN_RANDOM:
+        len = rand() % 9;
+        for (i = 0; i < len; ++i)
+            payload[i] = rand();
+        nr_build_report(data,
+                        extended ? rand() & 0x1fffffff : rand() & 0x7ff,
+                        extended, payload, len);
+        break;
+    }
+}
+
+// send a report on the IN endpoint, waits for the host to poll it
+static int nr_send(const uint8_t *data)
+{
+    ssize_t n;
+
+    pthread_mutex_lock(&in_lock);
+    n = write(ep_in, data, NR_FRAME_SIZE);
+    pthread_mutex_unlock(&in_lock);
+    if (n < 0)
+        return -errno;
+    __atomic_fetch_add(&sent, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//------------------------------------------------------------
+//                         THREADS
+//------------------------------------------------------------
+// events of the control endpoint: the driver does not send any control
+//   request, they are refused
+static void *nr_ep0_thread(void *arg)
+{
+    struct usb_functionfs_event event;
+    ssize_t n;
+
+    for (;;)
+    {
+        n = read(ep0, &event, sizeof(event));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("ep0");
+            exit(1);
+        }
+        switch (event.type)
+        {
+        case FUNCTIONFS_ENABLE:
+            fprintf(stderr, "nr_emulator: enabled\n");
+            break;
+        case FUNCTIONFS_DISABLE:
+            fprintf(stderr, "nr_emulator: disabled\n");
+            break;
+        case FUNCTIONFS_SETUP:
+            // stall: a 0 bytes transfer in the wrong direction
+            if (event.u.setup.bRequestType & USB_DIR_IN)
+                n = read(ep0, NULL, 0);
+            else
+                n = write(ep0, NULL, 0);
+            break;
+        default:
+            break;
+        }
+    }
+    return NULL;
+}
+
+// the reports written by the driver, sent back in loopback mode
+static void *nr_out_thread(void *arg)
+{
+    uint8_t data[NR_FRAME_SIZE];
+    ssize_t n;
+
+    for (;;)
+    {
+        n = read(ep_out, data, sizeof(data));
+        if (n < 0)
+        {
+            // the gadget is not enabled yet, or has been unbound
+            if (errno == EINTR || errno == ESHUTDOWN || errno == ENODEV)
+            {
+                usleep(10000);
+                continue;
+            }
+            perror("OUT endpoint");
+            exit(1);
+        }
+        __atomic_fetch_add(&received, 1, __ATOMIC_RELAXED);
+        if (!loopback)
+            continue;
+
+        // the driver sends whole 64 bytes reports
+        if (n < NR_FRAME_SIZE)
+            memset(data + n, 0, NR_FRAME_SIZE - n);
+        nr_send(data);
+    }
+    return NULL;
+}
+
+// the reports of the pattern, burst of them every burst / rate seconds
+static void *nr_gen_thread(void *arg)
+{
+    uint8_t data[NR_FRAME_SIZE];
+    uint64_t period = 1000000000ULL * burst / rate;
+    uint64_t seq = 0;
+    struct timespec next;
+    unsigned int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (;;)
+    {
+        for (i = 0; i < burst; ++i)
+        {
+            nr_next_report(data, seq++);
+            if (nr_send(data) < 0)
+                usleep(10000); // not enabled yet
+        }
+
+        // absolute deadlines: the rate does not drift when sending is slow
+        next.tv_nsec += period % 1000000000ULL;
+        next.tv_sec += period / 1000000000ULL + next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------
+//                          MAIN
+//------------------------------------------------------------
+static void nr_usage(void)
+{
+    fprintf(stderr,
+            "usage: nr_emulator [-r rate] [-b burst] "
+            "[-p counter|fixed|random] [-i id] [-x] [-n] [-v] <ffs dir>\n");
+    exit(2);
+}
+
+static int nr_open_ep(const char *dir, const char *name, int flags)
+{
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, flags);
+    if (fd < 0)
+    {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t thread;
+    unsigned long last_sent = 0, last_received = 0, s, r;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:b:p:i:xnv")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            burst = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            if (!strcmp(optarg, "counter"))
+                pattern = NR_PATTERN_COUNTER;
+            else if (!strcmp(optarg, "fixed"))
+                pattern = NR_PATTERN_FIXED;
+            else if (!strcmp(optarg, "random"))
+                pattern = NR_PATTERN_RANDOM;
+            else
+                nr_usage();
+            break;
+        case 'i':
+            can_id = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            extended = true;
+            break;
+        case 'n':
+            loopback = false;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            nr_usage();
+        }
+    }
+    if (optind != argc - 1 || burst == 0)
+        nr_usage();
+
+    // the descriptors make the endpoint files appear in the mount point
+    ep0 = nr_open_ep(argv[optind], "ep0", O_RDWR);
+    if (write(ep0, &descriptors, sizeof(descriptors)) < 0 ||
+        write(ep0, &strings, sizeof(strings)) < 0)
+    {
+        perror("writing the descriptors");
+        return 1;
+    }
+    ep_in = nr_open_ep(argv[optind], "ep1", O_WRONLY);
+    ep_out = nr_open_ep(argv[optind], "ep2", O_RDONLY);
+    fprintf(stderr, "nr_emulator: ready, the gadget can be bound\n");
+
+    pthread_create(&thread, NULL, nr_ep0_thread, NULL);
+    pthread_create(&thread, NULL, nr_out_thread, NULL);
+    if (rate)
+        pthread_create(&thread, NULL, nr_gen_thread, NULL);
+
+    for (;;)
+    {
+        sleep(1);
+        if (!verbose)
+            continue;
+        s = __atomic_load_n(&sent, __ATOMIC_RELAXED);
+        r = __atomic_load_n(&received, __ATOMIC_RELAXED);
+        fprintf(stderr, "nr_emulator: in %lu/s out %lu/s\n", s - last_sent,
+                r - last_received);
+        last_sent = s;
+        last_received = r;
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+#!/bin/bash
+
+# Plug an emulated 04d8:0070 adapter into this machine, to run nr_driver
+#   without the real one: the dummy_hcd module provides a virtual USB host
+#   controller and device controller connected to each other, the gadget
+#   (built with configfs) has one FunctionFS function served by nr_emulator.
+#
+#   sudo ./nr_emulator_setup.sh start [nr_emulator options]
+#   sudo ./nr_emulator_setup.sh stop
+#
+# The options are given to nr_emulator (for instance -r 1000 -p random), see
+#   nr_emulator.c. nr_driver has to be loaded (insmod nr_driver.ko) for the
+#   emulated adapter to show up as /dev/nr_driverX.
+
+VENDOR_ID="0x04d8"
+PRODUCT_ID="0x0070"
+GADGET="/sys/kernel/config/usb_gadget/nr_emulator"
+FFS="/dev/ffs-nr"
+PIDFILE="/run/nr_emulator.pid"
+
+set -e # this will cause the script to exit on the first error
+
+start() {
+	# the virtual controllers, the gadget framework and FunctionFS
+	printf "[..]\tloading dummy_hcd and libcomposite"
+	modprobe dummy_hcd
+	modprobe libcomposite
+	modprobe usb_f_fs
+	mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+	printf "\r[OK]\tloading dummy_hcd and libcomposite\n"
+
+	# the device as the driver expects it (see id_table in nr_driver.c)
+	printf "[..]\tcreating the gadget"
+	mkdir -p $GADGET
+	echo $VENDOR_ID > $GADGET/idVendor
+	echo $PRODUCT_ID > $GADGET/idProduct
+	echo 0x0200 > $GADGET/bcdUSB
+	mkdir -p $GADGET/strings/0x409
+	echo "nr_driver" > $GADGET/strings/0x409/manufacturer
+	echo "CAN bridge emulator" > $GADGET/strings/0x409/product
+	echo "0001" > $GADGET/strings/0x409/serialnumber
+	mkdir -p $GADGET/configs/c.1/strings/0x409
+	echo "emulator" > $GADGET/configs/c.1/strings/0x409/configuration
+	mkdir -p $GADGET/functions/ffs.nr
+	ln -sf $GADGET/functions/ffs.nr $GADGET/configs/c.1/
+	mkdir -p $FFS
+	mountpoint -q $FFS || mount -t functionfs nr $FFS
+	printf "\r[OK]\tcreating the gadget\n"
+
+	# the endpoints only exist once nr_emulator wrote the descriptors
+	printf "[..]\tstarting nr_emulator"
+	"$(dirname "$0")/nr_emulator" "$@" $FFS &
+	echo $! > $PIDFILE
+	for (( i=50; i>0; i--)); do
+		[ -e $FFS/ep2 ] && break
+		sleep 0.1
+	done
+	[ -e $FFS/ep2 ]
+	printf "\r[OK]\tstarting nr_emulator\n"
+
+	# plug the gadget
+	printf "[..]\tbinding the gadget"
+	ls /sys/class/udc | grep dummy_udc | head -n 1 > $GADGET/UDC
+	printf "\r[OK]\tbinding the gadget\n"
+}
+
+stop() {
+	printf "[..]\tremoving the gadget"
+	[ -e $GADGET/UDC ] && echo "" > $GADGET/UDC || true
+	if [ -e $PIDFILE ]; then
+		kill "$(cat $PIDFILE)" 2> /dev/null || true
+		rm -f $PIDFILE
+	fi
+	sleep 0.1
+	mountpoint -q $FFS && umount $FFS || true
+	rm -f $GADGET/configs/c.1/ffs.nr
+	rmdir $GADGET/configs/c.1/strings/0x409 $GADGET/configs/c.1 \
+		$GADGET/functions/ffs.nr $GADGET/strings/0x409 $GADGET 2> /dev/null || true
+	printf "\r[OK]\tremoving the gadget\n"
+}
+
+case "$1" in
+start)
+	shift
+	start "$@"
+	;;
+stop)
+	stop
+	;;
+*)
+	echo "usage: $0 start [nr_emulator options] | stop"
+	exit 2
+	;;
+esac
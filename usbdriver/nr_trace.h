@@ -0,0 +1,184 @@
+/*
+ * Tracepoints of the nr_driver kernel module, for ftrace and perf:
+ *
+ *      echo 1 > /sys/kernel/tracing/events/nr_driver/enable
+ *      cat /sys/kernel/tracing/trace_pipe
+ *
+ *      perf record -e 'nr_driver:*' -a
+ *
+ * A disabled tracepoint costs a patched out branch, so they stay in the data
+ * path. nr_driver.c includes this file once, with CREATE_TRACE_POINTS
+ * defined: <trace/define_trace.h> then includes it again (with
+ * TRACE_HEADER_MULTI_READ) to generate the code of the events.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nr_driver
+
+#if !defined(NR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define NR_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+// open() and release() of /dev/nr_driverX
+DECLARE_EVENT_CLASS(nr_file,
+    TP_PROTO(int minor, int reader),
+    TP_ARGS(minor, reader),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(int, reader)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->reader = reader;
+    ),
+
+    // reader is the bit of the file in the delivery masks, -1 if it is not
+    //   open for reading
+    TP_printk("minor=%d reader=%d", __entry->minor, __entry->reader)
+);
+
+DEFINE_EVENT(nr_file, nr_open,
+    TP_PROTO(int minor, int reader),
+    TP_ARGS(minor, reader)
+);
+
+DEFINE_EVENT(nr_file, nr_release,
+    TP_PROTO(int minor, int reader),
+    TP_ARGS(minor, reader)
+);
+
+// entry of read() and write(): the size of the request
+DECLARE_EVENT_CLASS(nr_io_enter,
+    TP_PROTO(size_t count, bool nowait),
+    TP_ARGS(count, nowait),
+
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(bool, nowait)
+    ),
+
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->nowait = nowait;
+    ),
+
+    TP_printk("count=%zu nowait=%d", __entry->count, __entry->nowait)
+);
+
+DEFINE_EVENT(nr_io_enter, nr_read_enter,
+    TP_PROTO(size_t count, bool nowait),
+    TP_ARGS(count, nowait)
+);
+
+DEFINE_EVENT(nr_io_enter, nr_write_enter,
+    TP_PROTO(size_t count, bool nowait),
+    TP_ARGS(count, nowait)
+);
+
+// exit of read() and write(): the number of bytes or the error
+DECLARE_EVENT_CLASS(nr_io_exit,
+    TP_PROTO(ssize_t ret),
+    TP_ARGS(ret),
+
+    TP_STRUCT__entry(
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->ret = ret;
+    ),
+
+    TP_printk("ret=%zd", __entry->ret)
+);
+
+DEFINE_EVENT(nr_io_exit, nr_read_exit,
+    TP_PROTO(ssize_t ret),
+    TP_ARGS(ret)
+);
+
+DEFINE_EVENT(nr_io_exit, nr_write_exit,
+    TP_PROTO(ssize_t ret),
+    TP_ARGS(ret)
+);
+
+// an urb is submitted (IN or OUT), with the length of the transfer
+TRACE_EVENT(nr_urb_submit,
+    TP_PROTO(struct urb *urb),
+    TP_ARGS(urb),
+
+    TP_STRUCT__entry(
+        __field(const void *, urb)
+        __field(bool, in)
+        __field(u32, length)
+    ),
+
+    TP_fast_assign(
+        __entry->urb = urb;
+        __entry->in = usb_urb_dir_in(urb);
+        __entry->length = urb->transfer_buffer_length;
+    ),
+
+    TP_printk("urb=%p %s length=%u", __entry->urb,
+              __entry->in ? "in" : "out", __entry->length)
+);
+
+// an urb has completed, from its completion handler
+TRACE_EVENT(nr_urb_complete,
+    TP_PROTO(struct urb *urb),
+    TP_ARGS(urb),
+
+    TP_STRUCT__entry(
+        __field(const void *, urb)
+        __field(bool, in)
+        __field(int, status)
+        __field(u32, actual_length)
+    ),
+
+    TP_fast_assign(
+        __entry->urb = urb;
+        __entry->in = usb_urb_dir_in(urb);
+        __entry->status = urb->status;
+        __entry->actual_length = urb->actual_length;
+    ),
+
+    TP_printk("urb=%p %s status=%d actual_length=%u", __entry->urb,
+              __entry->in ? "in" : "out", __entry->status,
+              __entry->actual_length)
+);
+
+// frames lost by a consumer of the receive ring (a reader, or the network
+//   interface as reader -1) because they were overwritten, or frames of the
+//   transmit ring that could not be sent (rx false)
+TRACE_EVENT(nr_overflow,
+    TP_PROTO(bool rx, int reader, unsigned int lost),
+    TP_ARGS(rx, reader, lost),
+
+    TP_STRUCT__entry(
+        __field(bool, rx)
+        __field(int, reader)
+        __field(unsigned int, lost)
+    ),
+
+    TP_fast_assign(
+        __entry->rx = rx;
+        __entry->reader = reader;
+        __entry->lost = lost;
+    ),
+
+    TP_printk("%s reader=%d lost=%u", __entry->rx ? "rx" : "tx",
+              __entry->reader, __entry->lost)
+);
+
+#endif // NR_TRACE_H
+
+// the header is not in include/trace/events/: define_trace.h looks for it in
+//   the directory of the module, which the Makefile adds to the include path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nr_trace
+#include <trace/define_trace.h>
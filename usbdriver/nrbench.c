@@ -0,0 +1,752 @@
+/*
+ * Load generator and benchmark of nr_driver, to measure every change of the
+ * driver the same way. It drives one or several /dev/nr_driverX with reader
+ * and writer threads for a given time and reports the frames and bytes per
+ * second, the cpu time per frame and the latency percentiles, as text or as
+ * JSON (-j) for scripts.
+ *
+ * Usage: nrbench [options]
+ *      -m mode     read:  read the frames received (the latency is from the
+ *                         arrival of the frame in the driver, taken by
+ *                         NR_IOC_SET_RX_TSTAMP, to read() returning)
+ *                  write: send frames (the latency is the one of write())
+ *                  rw:    both at once
+ *                  rtt:   write a frame and wait for it to come back (the
+ *                         adapter in loopback mode or the emulator), see
+ *                         ROUND TRIP below
+ *                  (default read)
+ *      -d device   device to use, can be repeated (default /dev/nr_driver0)
+ *      -t threads  threads per device and direction (default 1)
+ *      -s size     bytes per frame written, 1 to 64 (default 64)
+ *      -b burst    frames per read() and per write() (default 1, the frames
+ *                  of a burst are 64 bytes)
+ *      -r rate     frames per second and writer thread, 0 for as fast as
+ *                  possible (default 0)
+ *      -T seconds  duration (default 10), rtt runs until -n round trips
+ *      -i id       CAN identifier of the frames written, a standard one
+ *                  (0 to 0x7ff, default 0x123)
+ *      -j          JSON output
+ *      -n count    rtt: round trips per thread (default 100000)
+ *      -w ms       rtt: time to wait for a frame to come back before it is
+ *                  counted as lost (default 1000)
+ *      -D dir      debugfs directory of the device (for instance
+ *                  /sys/kernel/debug/nr_driver/1-1:1.0): its histograms are
+ *                  cleared at the start and printed (on stderr) at the end
+ *
+ * With the emulator (nr_emulator_setup.sh) the frames written come back, so
+ * "-m rw" measures both directions on a machine without the adapter.
+ *
+ * ROUND TRIP: every frame written carries the CAN identifier of -i and a
+ * counter, and the thread reads until the same frame comes back (a filter on
+ * the identifier keeps the other frames away). The round trip is split in:
+ *      write:   time spent in write(), which submits the OUT urb
+ *      wire:    from write() returning to the arrival of the frame back in
+ *               the driver (timestamp of NR_IOC_SET_RX_TSTAMP): the OUT urb,
+ *               the device and the IN urb
+ *      deliver: from that arrival to read() returning (wakeup, copy)
+ * The urbs themselves are measured by the driver, in the tx_urb (submit to
+ * completion of the OUT urb) and write (write() to completion) histograms
+ * of debugfs, shown with -D.
+ *
+ * Build: make tools
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "nr_driver.h" // ioctl commands, layout of the reports
+
+#define NR_MAX_DEVICES 16
+#define NR_MAX_THREADS 64
+#define NR_MAX_BURST 64
+
+//------------------------------------------------------------
+//                   LATENCY HISTOGRAM
+//------------------------------------------------------------
+// Log-linear histogram of nanoseconds: 32 buckets per power of two, so a
+//   percentile is given within 3% whatever the scale, in a fixed size.
+#define NR_HIST_SUB_BITS 5
+#define NR_HIST_SUB (1 << NR_HIST_SUB_BITS)
+#define NR_HIST_SIZE ((64 - NR_HIST_SUB_BITS) * NR_HIST_SUB + NR_HIST_SUB)
+
+struct nr_hist
+{
+    uint64_t count[NR_HIST_SIZE];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+static unsigned int nr_hist_index(uint64_t ns)
+{
+    unsigned int e;
+
+    if (ns < NR_HIST_SUB)
+        return ns;
+    e = 63 - __builtin_clzll(ns);
+    return (e - NR_HIST_SUB_BITS + 1) * NR_HIST_SUB +
+           ((ns >> (e - NR_HIST_SUB_BITS)) & (NR_HIST_SUB - 1));
+}
+
+// lowest value of a bucket
+static uint64_t nr_hist_value(unsigned int index)
+{
+    unsigned int e;
+
+    if (index < NR_HIST_SUB)
+        return index;
+    e = index / NR_HIST_SUB + NR_HIST_SUB_BITS - 1;
+    return (1ULL << e) |
+           ((uint64_t)(index % NR_HIST_SUB) << (e - NR_HIST_SUB_BITS));
+}
+
+static void nr_hist_add(struct nr_hist *hist, uint64_t ns)
+{
+    hist->count[nr_hist_index(ns)]++;
+    if (hist->total == 0 || ns < hist->min)
+        hist->min = ns;
+    if (ns > hist->max)
+        hist->max = ns;
+    hist->total++;
+}
+
+static void nr_hist_merge(struct nr_hist *to, const struct nr_hist *from)
+{
+    unsigned int i;
+
+    if (from->total == 0)
+        return;
+    for (i = 0; i < NR_HIST_SIZE; ++i)
+        to->count[i] += from->count[i];
+    if (to->total == 0 || from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+    to->total += from->total;
+}
+
+// value below which permille / 1000 of the samples are
+static uint64_t nr_hist_percentile(const struct nr_hist *hist,
+                                   unsigned int permille)
+{
+    uint64_t seen = 0;
+    unsigned int i;
+
+    if (hist->total == 0)
+        return 0;
+    for (i = 0; i < NR_HIST_SIZE; ++i)
+    {
+        seen += hist->count[i];
+        if (seen * 1000 >= hist->total * permille)
+            break;
+    }
+    if (i + 1 >= NR_HIST_SIZE)
+        return hist->max;
+    // the upper bound of the bucket, never above the largest sample
+    return nr_hist_value(i + 1) < hist->max ? nr_hist_value(i + 1)
+                                            : hist->max;
+}
+
+//------------------------------------------------------------
+//                        SETTINGS
+//------------------------------------------------------------
+enum nr_mode
+{
+    NR_MODE_READ = 1,
+    NR_MODE_WRITE = 2,
+    NR_MODE_RW = NR_MODE_READ | NR_MODE_WRITE,
+    NR_MODE_RTT = 4,
+};
+
+static enum nr_mode mode = NR_MODE_READ;
+static const char *devices[NR_MAX_DEVICES];
+static unsigned int n_devices;
+static unsigned int threads = 1;
+static unsigned int frame_size = NR_FRAME_SIZE;
+static unsigned int burst = 1;
+static unsigned long rate;
+static double duration = 10;
+static uint32_t can_id = 0x123;
+static bool json;
+static unsigned long iterations = 100000;
+static unsigned int rtt_timeout = 1000;
+static const char *debugfs_dir;
+
+// set by main() once the duration elapsed
+static volatile bool stop;
+
+enum nr_role
+{
+    NR_ROLE_READER,
+    NR_ROLE_WRITER,
+    NR_ROLE_RTT,
+};
+
+// one reader, writer or round trip thread
+struct nr_worker
+{
+    const char *device;
+    enum nr_role role;
+    pthread_t thread;
+    int fd;
+
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t errors;
+
+    // reader: frames the driver reported lost (NR_IOC_GET_RX_STATS)
+    uint64_t overruns;
+
+    // the latency of the frames, the whole round trip for NR_ROLE_RTT
+    struct nr_hist lat;
+
+    // NR_ROLE_RTT: the parts of the round trip and the frames that did not
+    //   come back in time
+    struct nr_hist write;
+    struct nr_hist wire;
+    struct nr_hist deliver;
+    uint64_t timeouts;
+};
+
+static struct nr_worker workers[NR_MAX_THREADS];
+static unsigned int n_workers;
+
+//------------------------------------------------------------
+//                         WORKERS
+//------------------------------------------------------------
+static uint64_t nr_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void nr_sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ULL,
+        .tv_nsec = deadline % 1000000000ULL,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR)
+        ;
+}
+
+// a report sending a CAN frame with the given identifier and an 8 bytes
+//   counter, laid out as the ones of nrtest_write.py (see nr_driver.h)
+static void nr_build_report(uint8_t *data, uint32_t id, uint64_t seq)
+{
+    uint32_t sid = id & 0x7ff;
+
+    memset(data, 0, NR_FRAME_SIZE);
+    data[NR_FRAME_CMD] = NR_CMD_TX;
+    data[NR_FRAME_SIDH] = sid >> 3;
+    data[NR_FRAME_SIDL] = (sid & 0x07) << 5;
+    data[NR_FRAME_DLC] = 8;
+    memcpy(&data[NR_FRAME_DATA], &seq, sizeof(seq));
+}
+
+static void *nr_reader(void *arg)
+{
+    struct nr_worker *w = arg;
+    size_t record = sizeof(struct nr_rx_header) + NR_FRAME_SIZE;
+    uint8_t buf[NR_MAX_BURST * (sizeof(struct nr_rx_header) + NR_FRAME_SIZE)];
+    struct nr_rx_header hdr;
+    struct pollfd pfd = {.fd = w->fd, .events = POLLIN};
+    uint64_t now;
+    ssize_t n, off;
+
+    while (!stop)
+    {
+        // poll() with a timeout, to notice the end of the test
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        n = read(w->fd, buf, burst * record);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            w->errors++;
+            if (errno == ENODEV)
+                break;
+            continue;
+        }
+
+        // every record starts with its header, see NR_IOC_SET_RX_TSTAMP
+        now = nr_now();
+        for (off = 0; off + (ssize_t)sizeof(hdr) <= n;
+             off += sizeof(hdr) + hdr.len)
+        {
+            memcpy(&hdr, buf + off, sizeof(hdr));
+            nr_hist_add(&w->lat, now - hdr.tstamp);
+            w->frames++;
+            w->bytes += hdr.len;
+        }
+    }
+    return NULL;
+}
+
+static void *nr_writer(void *arg)
+{
+    struct nr_worker *w = arg;
+    uint8_t buf[NR_MAX_BURST * NR_FRAME_SIZE];
+    size_t len = burst > 1 ? burst * NR_FRAME_SIZE : frame_size;
+    uint64_t period = rate ? 1000000000ULL * burst / rate : 0;
+    uint64_t next = nr_now(), start;
+    uint64_t seq = 0;
+    unsigned int i;
+    ssize_t n;
+
+    while (!stop)
+    {
+        for (i = 0; i < burst; ++i)
+            nr_build_report(buf + i * NR_FRAME_SIZE, can_id, seq++);
+
+        start = nr_now();
+        n = write(w->fd, buf, len);
+        if (n < 0)
+        {
+            w->errors++;
+            if (errno == ENODEV)
+                break;
+        }
+        else
+        {
+            nr_hist_add(&w->lat, nr_now() - start);
+            // an interrupted batch returns the bytes of the frames queued
+            w->frames += burst > 1 ? n / NR_FRAME_SIZE : 1;
+            w->bytes += n;
+        }
+
+        // absolute deadlines: the rate does not drift when write() is slow
+        if (period)
+        {
+            next += period;
+            nr_sleep_until(next);
+        }
+    }
+    return NULL;
+}
+
+// wait for the frame of the given counter to come back, returns the time
+//   the driver received it, 0 if it did not come back in time
+static uint64_t nr_rtt_wait(struct nr_worker *w, uint64_t seq,
+                            uint64_t deadline)
+{
+    uint8_t buf[sizeof(struct nr_rx_header) + NR_FRAME_SIZE];
+    struct nr_rx_header hdr;
+    struct pollfd pfd = {.fd = w->fd, .events = POLLIN};
+    uint64_t now, got;
+    ssize_t n;
+
+    while (!stop && (now = nr_now()) < deadline)
+    {
+        if (poll(&pfd, 1, (deadline - now) / 1000000 + 1) <= 0)
+            continue;
+        n = read(w->fd, buf, sizeof(buf));
+        if (n < (ssize_t)(sizeof(hdr) + NR_FRAME_DATA + sizeof(got)))
+        {
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                w->errors++;
+                if (errno == ENODEV)
+                    stop = true;
+            }
+            continue;
+        }
+        memcpy(&hdr, buf, sizeof(hdr));
+        memcpy(&got, buf + sizeof(hdr) + NR_FRAME_DATA, sizeof(got));
+        // a frame of a previous round trip that came back too late
+        if (got == seq)
+            return hdr.tstamp;
+    }
+    return 0;
+}
+
+static void *nr_rtt(void *arg)
+{
+    struct nr_worker *w = arg;
+    uint8_t frame[NR_FRAME_SIZE];
+    uint64_t t0, t1, t2, rx;
+    uint64_t seq;
+    unsigned long i;
+
+    // the high bits tell the frames of this thread from the ones of the
+    //   others, and of other programs using the same identifier
+    seq = (uint64_t)(getpid() ^ (uintptr_t)w) << 32;
+    for (i = 0; i < iterations && !stop; ++i, ++seq)
+    {
+        nr_build_report(frame, can_id, seq);
+
+        t0 = nr_now();
+        if (write(w->fd, frame, frame_size) < 0)
+        {
+            w->errors++;
+            if (errno == ENODEV)
+                break;
+            continue;
+        }
+        t1 = nr_now();
+
+        rx = nr_rtt_wait(w, seq, t1 + rtt_timeout * 1000000ULL);
+        t2 = nr_now();
+        if (rx == 0)
+        {
+            w->timeouts++;
+            continue;
+        }
+        nr_hist_add(&w->lat, t2 - t0);
+        nr_hist_add(&w->write, t1 - t0);
+        // the clocks are the same, but the timestamp of the driver can be a
+        //   little before the return of write() when the device is fast
+        nr_hist_add(&w->wire, rx > t1 ? rx - t1 : 0);
+        nr_hist_add(&w->deliver, t2 - rx);
+        w->frames++;
+        w->bytes += frame_size;
+    }
+    return NULL;
+}
+
+static int nr_add_worker(const char *device, enum nr_role role)
+{
+    struct nr_worker *w;
+    __u32 clock = NR_TSTAMP_MONOTONIC;
+    __u32 id = can_id;
+    struct nr_filter_req filter = {
+        .n_ids = 1,
+        .ids = (__u64)(uintptr_t)&id,
+    };
+    int flags[] = {
+        [NR_ROLE_READER] = O_RDONLY | O_NONBLOCK,
+        [NR_ROLE_WRITER] = O_WRONLY,
+        [NR_ROLE_RTT] = O_RDWR,
+    };
+
+    if (n_workers == NR_MAX_THREADS)
+    {
+        fprintf(stderr, "nrbench: too many threads\n");
+        return -1;
+    }
+    w = &workers[n_workers++];
+    w->device = device;
+    w->role = role;
+    w->fd = open(device, flags[role]);
+    if (w->fd < 0)
+    {
+        perror(device);
+        return -1;
+    }
+    if (role != NR_ROLE_WRITER &&
+        ioctl(w->fd, NR_IOC_SET_RX_TSTAMP, &clock) < 0)
+    {
+        perror("NR_IOC_SET_RX_TSTAMP");
+        return -1;
+    }
+    if (role == NR_ROLE_RTT && ioctl(w->fd, NR_IOC_SET_FILTER, &filter) < 0)
+    {
+        perror("NR_IOC_SET_FILTER");
+        return -1;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------
+//                         REPORT
+//------------------------------------------------------------
+// the percentiles of a histogram, as a line of text or a JSON object
+static void nr_report_hist(const char *name, const struct nr_hist *hist)
+{
+    static const unsigned int permille[] = {500, 900, 990, 999};
+    static const char *const labels[] = {"p50", "p90", "p99", "p999"};
+    unsigned int i;
+
+    if (json)
+        printf(",\"%s_ns\":{\"min\":%llu", name, (unsigned long long)hist->min);
+    else
+        printf("%-6s %-8s ns: min %llu", "", name,
+               (unsigned long long)hist->min);
+    for (i = 0; i < 4; ++i)
+        printf(json ? ",\"%s\":%llu" : "  %s %llu", labels[i],
+               (unsigned long long)nr_hist_percentile(hist, permille[i]));
+    printf(json ? ",\"max\":%llu}" : "  max %llu\n",
+           (unsigned long long)hist->max);
+}
+
+// the sums of the threads of a role
+static void nr_report_role(const char *name, enum nr_role role,
+                           double seconds, double cpu_ns)
+{
+    struct nr_hist *lat = calloc(4, sizeof(*lat));
+    uint64_t frames = 0, bytes = 0, errors = 0, overruns = 0, timeouts = 0;
+    unsigned int i, n = 0;
+
+    for (i = 0; i < n_workers; ++i)
+    {
+        if (workers[i].role != role)
+            continue;
+        frames += workers[i].frames;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+        overruns += workers[i].overruns;
+        timeouts += workers[i].timeouts;
+        nr_hist_merge(&lat[0], &workers[i].lat);
+        nr_hist_merge(&lat[1], &workers[i].write);
+        nr_hist_merge(&lat[2], &workers[i].wire);
+        nr_hist_merge(&lat[3], &workers[i].deliver);
+        n++;
+    }
+    if (n == 0)
+    {
+        free(lat);
+        return;
+    }
+
+    if (json)
+        printf(",\"%s\":{\"threads\":%u,\"frames\":%llu,\"bytes\":%llu,"
+               "\"errors\":%llu,\"overruns\":%llu,\"timeouts\":%llu,"
+               "\"frames_per_s\":%.1f,\"mb_per_s\":%.3f,"
+               "\"cpu_ns_per_frame\":%.0f",
+               name, n, (unsigned long long)frames,
+               (unsigned long long)bytes, (unsigned long long)errors,
+               (unsigned long long)overruns, (unsigned long long)timeouts,
+               frames / seconds, bytes / seconds / 1e6, cpu_ns);
+    else
+        printf("%-6s threads %u  frames %llu (%.1f/s)  %.3f MB/s  "
+               "errors %llu  overruns %llu  timeouts %llu\n",
+               name, n, (unsigned long long)frames, frames / seconds,
+               bytes / seconds / 1e6, (unsigned long long)errors,
+               (unsigned long long)overruns, (unsigned long long)timeouts);
+    nr_report_hist("latency", &lat[0]);
+    if (role == NR_ROLE_RTT)
+    {
+        nr_report_hist("write", &lat[1]);
+        nr_report_hist("wire", &lat[2]);
+        nr_report_hist("deliver", &lat[3]);
+    }
+    if (json)
+        printf("}");
+    free(lat);
+}
+
+// clear (or print, on stderr) the histograms kept by the driver in debugfs
+static void nr_debugfs(bool print)
+{
+    static const char *const names[] = {"tx_urb", "write", "rx_urb", "read"};
+    char path[4096], line[256];
+    unsigned int i;
+    FILE *f;
+
+    if (!debugfs_dir)
+        return;
+    for (i = 0; i < 4; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/%s", debugfs_dir, names[i]);
+        f = fopen(path, print ? "r" : "w");
+        if (!f)
+        {
+            perror(path);
+            continue;
+        }
+        if (print)
+        {
+            fprintf(stderr, "%s:\n", path);
+            while (fgets(line, sizeof(line), f))
+                fputs(line, stderr);
+        }
+        else
+            fputs("0\n", f);
+        fclose(f);
+    }
+}
+
+//------------------------------------------------------------
+//                          MAIN
+//------------------------------------------------------------
+static void nr_usage(void)
+{
+    fprintf(stderr,
+            "usage: nrbench [-m read|write|rw|rtt] [-d device]... "
+            "[-t threads] [-s size] [-b burst] [-r rate] [-T seconds] "
+            "[-i id] [-j] [-n count] [-w ms] [-D debugfs dir]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static void *(*const routines[])(void *) = {
+        [NR_ROLE_READER] = nr_reader,
+        [NR_ROLE_WRITER] = nr_writer,
+        [NR_ROLE_RTT] = nr_rtt,
+    };
+    struct rusage ru0, ru1;
+    struct nr_rx_stats stats;
+    uint64_t start, frames = 0;
+    double seconds, cpu;
+    unsigned int i, j;
+    unsigned long id;
+    char *end;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:d:t:s:b:r:T:i:jn:w:D:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            if (!strcmp(optarg, "read"))
+                mode = NR_MODE_READ;
+            else if (!strcmp(optarg, "write"))
+                mode = NR_MODE_WRITE;
+            else if (!strcmp(optarg, "rw"))
+                mode = NR_MODE_RW;
+            else if (!strcmp(optarg, "rtt"))
+                mode = NR_MODE_RTT;
+            else
+                nr_usage();
+            break;
+        case 'd':
+            if (n_devices == NR_MAX_DEVICES)
+                nr_usage();
+            devices[n_devices++] = optarg;
+            break;
+        case 't':
+            threads = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            frame_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            burst = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            duration = strtod(optarg, NULL);
+            break;
+        case 'i':
+            // the frames are built with a standard identifier, the filter
+            //   of rtt must be installed with the same one
+            id = strtoul(optarg, &end, 0);
+            if (end == optarg || *end || id > 0x7ff)
+            {
+                fprintf(stderr, "nrbench: -i takes a standard CAN "
+                        "identifier, 0 to 0x7ff\n");
+                return 2;
+            }
+            can_id = id;
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            rtt_timeout = strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            debugfs_dir = optarg;
+            break;
+        default:
+            nr_usage();
+        }
+    }
+    if (optind != argc || threads == 0 || burst == 0 ||
+        burst > NR_MAX_BURST || frame_size == 0 ||
+        frame_size > NR_FRAME_SIZE || duration <= 0 || iterations == 0 ||
+        rtt_timeout == 0)
+        nr_usage();
+    // write() takes one frame or a whole number of 64 bytes frames
+    if (burst > 1 && frame_size != NR_FRAME_SIZE)
+    {
+        fprintf(stderr, "nrbench: a burst of frames needs -s 64\n");
+        return 2;
+    }
+    // the counter a round trip is matched with must fit in the frame written
+    if (mode == NR_MODE_RTT && frame_size < NR_FRAME_DATA + sizeof(uint64_t))
+    {
+        fprintf(stderr, "nrbench: rtt needs -s %zu or more\n",
+                NR_FRAME_DATA + sizeof(uint64_t));
+        return 2;
+    }
+    if (n_devices == 0)
+        devices[n_devices++] = "/dev/nr_driver0";
+
+    for (i = 0; i < n_devices; ++i)
+        for (j = 0; j < threads; ++j)
+        {
+            if ((mode & NR_MODE_READ) &&
+                nr_add_worker(devices[i], NR_ROLE_READER))
+                return 1;
+            if ((mode & NR_MODE_WRITE) &&
+                nr_add_worker(devices[i], NR_ROLE_WRITER))
+                return 1;
+            if ((mode & NR_MODE_RTT) && nr_add_worker(devices[i], NR_ROLE_RTT))
+                return 1;
+        }
+
+    nr_debugfs(false);
+    getrusage(RUSAGE_SELF, &ru0);
+    start = nr_now();
+    for (i = 0; i < n_workers; ++i)
+        pthread_create(&workers[i].thread, NULL, routines[workers[i].role],
+                       &workers[i]);
+    // the round trip threads stop by themselves after their iterations
+    if (mode != NR_MODE_RTT)
+    {
+        nr_sleep_until(start + (uint64_t)(duration * 1e9));
+        stop = true;
+    }
+    for (i = 0; i < n_workers; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].role == NR_ROLE_READER &&
+            ioctl(workers[i].fd, NR_IOC_GET_RX_STATS, &stats) == 0)
+            workers[i].overruns = stats.overruns;
+        frames += workers[i].frames;
+    }
+    seconds = (nr_now() - start) / 1e9;
+    getrusage(RUSAGE_SELF, &ru1);
+
+    // the cpu time of the process (user and system) per frame handled, the
+    //   completion handlers of the driver are not accounted for
+    cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec +
+           ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) * 1e9 +
+          (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec +
+           ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) * 1e3;
+    cpu = frames ? cpu / frames : 0;
+
+    if (json)
+        printf("{\"devices\":%u,\"duration_s\":%.3f,\"frame_size\":%u,"
+               "\"burst\":%u,\"rate\":%lu,",
+               n_devices, seconds, frame_size, burst, rate);
+    else
+        printf("nrbench: %u device(s), %.3f s, frame size %u, burst %u, "
+               "rate %lu/s, cpu %.0f ns/frame\n",
+               n_devices, seconds, frame_size, burst, rate, cpu);
+    if (json)
+        printf("\"cpu_ns_per_frame\":%.0f", cpu);
+    nr_report_role("read", NR_ROLE_READER, seconds, cpu);
+    nr_report_role("write", NR_ROLE_WRITER, seconds, cpu);
+    nr_report_role("rtt", NR_ROLE_RTT, seconds, cpu);
+    if (json)
+        printf("}\n");
+    nr_debugfs(true);
+
+    for (i = 0; i < n_workers; ++i)
+        close(workers[i].fd);
+    return 0;
+}